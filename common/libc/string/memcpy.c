@@ -47,39 +47,63 @@
 void *
 memcpy(void *dst, const void *src, size_t len)
 {
-	size_t i;
+	char *d = dst;
+	const char *s = src;
+	long *ld;
+	const long *ls;
 
 	/*
 	 * memcpy does not support overlapping buffers, so always do it
 	 * forwards. (Don't change this without adjusting memmove.)
 	 *
-	 * For speedy copying, optimize the common case where both pointers
-	 * and the length are word-aligned, and copy word-at-a-time instead
-	 * of byte-at-a-time. Otherwise, copy by bytes.
+	 * For speedy copying, if both pointers are equally misaligned,
+	 * copy bytes until they reach a word boundary together, then
+	 * copy words: eight at a time (a cache line) while there is
+	 * room, loading all eight before storing any, then singly. Any
+	 * bytes left at the end are copied one at a time, as is the
+	 * whole buffer if the pointers can never be aligned together.
 	 *
 	 * The alignment logic below should be portable. We rely on
 	 * the compiler to be reasonably intelligent about optimizing
 	 * the divides and modulos out. Fortunately, it is.
 	 */
 
-	if ((uintptr_t)dst % sizeof(long) == 0 &&
-	    (uintptr_t)src % sizeof(long) == 0 &&
-	    len % sizeof(long) == 0) {
+	if (((uintptr_t)d - (uintptr_t)s) % sizeof(long) == 0) {
+		while (len > 0 && (uintptr_t)d % sizeof(long) != 0) {
+			*d++ = *s++;
+			len--;
+		}
 
-		long *d = dst;
-		const long *s = src;
+		ld = (long *)d;
+		ls = (const long *)s;
+		while (len >= 8*sizeof(long)) {
+			long w0 = ls[0], w1 = ls[1], w2 = ls[2], w3 = ls[3];
+			long w4 = ls[4], w5 = ls[5], w6 = ls[6], w7 = ls[7];
 
-		for (i=0; i<len/sizeof(long); i++) {
-			d[i] = s[i];
+			ld[0] = w0;
+			ld[1] = w1;
+			ld[2] = w2;
+			ld[3] = w3;
+			ld[4] = w4;
+			ld[5] = w5;
+			ld[6] = w6;
+			ld[7] = w7;
+			ld += 8;
+			ls += 8;
+			len -= 8*sizeof(long);
+		}
+		while (len >= sizeof(long)) {
+			*ld++ = *ls++;
+			len -= sizeof(long);
 		}
+
+		d = (char *)ld;
+		s = (const char *)ls;
 	}
-	else {
-		char *d = dst;
-		const char *s = src;
 
-		for (i=0; i<len; i++) {
-			d[i] = s[i];
-		}
+	while (len > 0) {
+		*d++ = *s++;
+		len--;
 	}
 
 	return dst;
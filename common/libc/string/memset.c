@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * This file is shared between libc and the kernel, so don't put anything
+ * in here that won't work in both contexts.
+ */
+
+#ifdef _KERNEL
+#include <types.h>
+#include <lib.h>
+#else
+#include <stdint.h>
+#include <string.h>
+#endif
+
+/*
+ * C standard function - initialize a block of memory
+ */
+
+void *
+memset(void *ptr, int ch, size_t len)
+{
+	unsigned char *p = ptr;
+	unsigned long *lp, word;
+
+	/*
+	 * Store bytes up to the first word boundary, then the fill
+	 * pattern a word at a time, eight words (a cache line) per
+	 * iteration while there is room, then the leftover bytes.
+	 */
+
+	while (len > 0 && (uintptr_t)p % sizeof(long) != 0) {
+		*p++ = ch;
+		len--;
+	}
+
+	word = (unsigned char)ch;
+	word |= word << 8;
+	word |= word << 16;
+	if (sizeof(long) > 4) {
+		/* two steps, so the shift is never wider than a 32-bit long */
+		word |= (word << 16) << 16;
+	}
+
+	lp = (unsigned long *)p;
+	while (len >= 8*sizeof(long)) {
+		lp[0] = word;
+		lp[1] = word;
+		lp[2] = word;
+		lp[3] = word;
+		lp[4] = word;
+		lp[5] = word;
+		lp[6] = word;
+		lp[7] = word;
+		lp += 8;
+		len -= 8*sizeof(long);
+	}
+	while (len >= sizeof(long)) {
+		*lp++ = word;
+		len -= sizeof(long);
+	}
+
+	p = (unsigned char *)lp;
+	while (len > 0) {
+		*p++ = ch;
+		len--;
+	}
+
+	return ptr;
+}
@@ -43,6 +43,9 @@ typedef unsigned spinlock_data_t;
 void spinlock_data_set(volatile spinlock_data_t *sd, unsigned val);
 spinlock_data_t spinlock_data_get(volatile spinlock_data_t *sd);
 spinlock_data_t spinlock_data_testandset(volatile spinlock_data_t *sd);
+spinlock_data_t spinlock_data_cas(volatile spinlock_data_t *sd,
+				  spinlock_data_t oldval,
+				  spinlock_data_t newval);
 
 ////////////////////////////////////////////////////////////
 
@@ -93,5 +96,46 @@ spinlock_data_testandset(volatile spinlock_data_t *sd)
 	return x;
 }
 
+SPINLOCK_INLINE
+spinlock_data_t
+spinlock_data_cas(volatile spinlock_data_t *sd, spinlock_data_t oldval,
+		  spinlock_data_t newval)
+{
+	spinlock_data_t x;
+	spinlock_data_t y;
+
+	/*
+	 * Compare-and-swap using LL/SC: if *SD is OLDVAL, store
+	 * NEWVAL. Returns what was in *SD, so the swap happened if
+	 * that is OLDVAL.
+	 *
+	 * Load the existing value into X; if it isn't OLDVAL, skip
+	 * the SC. Y is set to NEWVAL in the branch delay slot, and
+	 * after the SC contains 1 if the store succeeded, 0 if it
+	 * failed, in which case try again: unlike test-and-set, a
+	 * spurious failure here would look like a real one.
+	 */
+	do {
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set volatile;"	/* avoid unwanted optimization */
+			".set noreorder;"	/* we fill the delay slot */
+			"ll %0, 0(%2);"		/*   x = *sd */
+			"bne %0, %3, 1f;"	/*   if (x != oldval) skip */
+			"move %1, %4;"		/*   y = newval */
+			"sc %1, 0(%2);"		/*   *sd = y; y = success? */
+			"1:"
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "=&r" (y)
+			: "r" (sd), "r" (oldval), "r" (newval)
+			: "memory");
+		if (x != oldval) {
+			return x;
+		}
+	} while (y == 0);
+	return x;
+}
+
 
 #endif /* _MIPS_SPINLOCK_H_ */
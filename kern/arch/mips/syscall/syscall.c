@@ -34,6 +34,7 @@
 #include <mips/trapframe.h>
 #include <thread.h>
 #include <current.h>
+#include <copyinout.h>
 #include <syscall.h>
 
 
@@ -81,7 +82,7 @@ syscall(struct trapframe *tf)
 	int callno;
 	int32_t retval;
 	int *errcode;
-	int err, whence;
+	int err, whence, fd;
 	off_t offset, new_offset;
 
 	KASSERT(curthread != NULL);
@@ -161,7 +162,33 @@ syscall(struct trapframe *tf)
 			retval = sys_execv((userptr_t)tf->tf_a0, (char **)tf->tf_a1, errcode);
 			break;
 		case SYS_sbrk:
-			retval = (int32_t)sys_sbrk((tf->tf_a0));
+			retval = (int32_t)sys_sbrk(tf->tf_a0, errcode);
+			break;
+		case SYS_mmap:
+			/* fd is on the stack at sp+16, the 64-bit offset at sp+24 */
+			err = copyin((const_userptr_t)(tf->tf_sp+16), &fd, sizeof(int));
+			if(!err) {
+				err = copyin((const_userptr_t)(tf->tf_sp+24), &offset, sizeof(off_t));
+			}
+			if(err) {
+				(*errcode) = err;
+				retval = -1;
+				break;
+			}
+			retval = (int32_t)sys_mmap((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2,
+			                           tf->tf_a3, fd, offset, errcode);
+			break;
+		case SYS_munmap:
+			retval = sys_munmap((userptr_t)tf->tf_a0, tf->tf_a1, errcode);
+			break;
+		case SYS_fsync:
+			retval = sys_fsync(tf->tf_a0, errcode);
+			break;
+		case SYS_sched_setaffinity:
+			retval = sys_sched_setaffinity(tf->tf_a0, tf->tf_a1, errcode);
+			break;
+		case SYS_sched_getaffinity:
+			retval = sys_sched_getaffinity(tf->tf_a0, (userptr_t)tf->tf_a1, errcode);
 			break;
 	    default:
 			kprintf("Unknown syscall %d\n", callno);
@@ -93,6 +93,21 @@ free_kpages(vaddr_t addr)
 	(void)addr;
 }
 
+bool
+vm_prezero_page(void)
+{
+	/* nothing to do */
+	return false;
+}
+
+int
+get_coremap_index(vaddr_t vbase)
+{
+	/* there is no coremap; kmalloc looks its pages up itself */
+	(void)vbase;
+	return -1;
+}
+
 void
 vm_tlbshootdown_all(void)
 {
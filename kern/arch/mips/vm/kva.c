@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <mips/tlb.h>
+#include <vm.h>
+
+/*
+ * Kernel virtual areas.
+ *
+ * Large kmallocs are mapped page by page into kseg2 through the TLB,
+ * so they need free pages but not physically contiguous ones. Each
+ * page of the window has a slot holding the physical page mapped
+ * there, or its state if nothing is; kernel TLB misses in kseg2 are
+ * refilled from the slots by kva_fault.
+ *
+ * Freeing an area doesn't shoot down TLB entries: its slots just
+ * become stale and are not handed out again. When the window fills
+ * up, every cpu's TLB is flushed once and the stale slots become
+ * free. This keeps kfree from ever waiting on other cpus. (A stale
+ * entry maps a page that has been freed, so using it is a use after
+ * free, as it would be in kseg0.)
+ */
+
+#define KVA_NPAGES 4096			/* 16M of kseg2 */
+
+#define KVA_FREE   0x0			/* slot states... */
+#define KVA_STALE  0x1
+#define KVA_BUSY   0x2
+#define KVA_PURGE  0x3
+#define KVA_MAPPED 0x4			/* ...or'd with the physical page */
+
+static struct spinlock kva_lock = SPINLOCK_INITIALIZER;
+static paddr_t kva_slots[KVA_NPAGES];
+static uint16_t kva_runlen[KVA_NPAGES];	/* pages, at each area's start */
+static unsigned kva_next;		/* where to start looking */
+static unsigned kva_nstale;
+
+#define KVA_VADDR(slot) (MIPS_KSEG2 + (vaddr_t)(slot) * PAGE_SIZE)
+#define KVA_SLOT(vaddr) (((vaddr) - MIPS_KSEG2) / PAGE_SIZE)
+
+/*
+ * Flush every cpu's TLB, and make the stale slots free again.
+ * Call with kva_lock held; it is dropped while waiting on other cpus,
+ * which must be done with interrupts on and no other spinlocks held.
+ */
+static
+void
+kva_purge(void)
+{
+	unsigned i;
+	int spl;
+
+	KASSERT(spinlock_do_i_hold(&kva_lock));
+
+	/* Only the slots that are stale now are known to be flushed */
+	for (i=0; i<KVA_NPAGES; i++) {
+		if (kva_slots[i] == KVA_STALE) {
+			kva_slots[i] = KVA_PURGE;
+		}
+	}
+	kva_nstale = 0;
+	spinlock_release(&kva_lock);
+	KASSERT(curthread->t_curspl == 0);
+
+	spl = splhigh();
+	vm_tlbshootdown_all();
+	splx(spl);
+	ipi_tlbshootdown_mask(~(uint32_t)0, NULL, 0);
+
+	spinlock_acquire(&kva_lock);
+	for (i=0; i<KVA_NPAGES; i++) {
+		if (kva_slots[i] == KVA_PURGE) {
+			kva_slots[i] = KVA_FREE;
+		}
+	}
+	kva_next = 0;
+}
+
+/*
+ * Find NPAGES free slots in a row from START, mark them busy, and
+ * return the first, or KVA_NPAGES if there is no such run.
+ * Call with kva_lock held.
+ */
+static
+unsigned
+kva_reserve(unsigned start, unsigned npages)
+{
+	unsigned first, i;
+
+	first = start;
+	for (i=start; i<KVA_NPAGES; i++) {
+		if (kva_slots[i] != KVA_FREE) {
+			first = i+1;
+		}
+		else if (i+1 - first == npages) {
+			for (i=first; i<first+npages; i++) {
+				kva_slots[i] = KVA_BUSY;
+			}
+			kva_runlen[first] = npages;
+			kva_next = first + npages;
+			return first;
+		}
+	}
+	return KVA_NPAGES;
+}
+
+/*
+ * Allocate NPAGES of kernel virtual memory, backed by any free
+ * physical pages. Returns 0 if out of memory or address space.
+ *
+ * Only a caller with interrupts on can purge stale slots: the purge
+ * waits for every other cpu to take an IPI, and two cpus doing that
+ * to each other with interrupts off would hang. (Holding a spinlock
+ * turns them off too.) Anyone else just fails when the window is
+ * full, and the next allocation that may wait does the purge.
+ */
+vaddr_t
+kva_alloc(unsigned long npages)
+{
+	unsigned first, i;
+	vaddr_t page;
+	bool canpurge;
+
+	if (npages == 0 || npages >= KVA_NPAGES) {
+		return 0;
+	}
+
+	canpurge = curthread->t_curspl == 0;
+
+	spinlock_acquire(&kva_lock);
+	first = kva_reserve(kva_next, npages);
+	if (first == KVA_NPAGES && kva_next > 0) {
+		first = kva_reserve(0, npages);
+	}
+	if (first == KVA_NPAGES && kva_nstale > 0 && canpurge) {
+		kva_purge();
+		first = kva_reserve(0, npages);
+	}
+	spinlock_release(&kva_lock);
+
+	if (first == KVA_NPAGES) {
+		kprintf("kmalloc: out of kernel virtual space\n");
+		return 0;
+	}
+
+	/* Get the pages without the lock, as alloc_kpages may sleep */
+	for (i=0; i<npages; i++) {
+		page = alloc_kpages(1);
+		if (page == 0) {
+			break;
+		}
+		kva_slots[first+i] = KVADDR_TO_PADDR(page) | KVA_MAPPED;
+	}
+
+	if (i < npages) {
+		/* Nothing has been touched through the TLB yet */
+		while (i-- > 0) {
+			free_kpages(PADDR_TO_KVADDR(kva_slots[first+i] & PAGE_FRAME));
+		}
+		spinlock_acquire(&kva_lock);
+		for (i=0; i<npages; i++) {
+			kva_slots[first+i] = KVA_FREE;
+		}
+		kva_runlen[first] = 0;
+		spinlock_release(&kva_lock);
+		return 0;
+	}
+
+	return KVA_VADDR(first);
+}
+
+/*
+ * Free an area from kva_alloc.
+ */
+void
+kva_free(vaddr_t vaddr)
+{
+	unsigned first, npages, i;
+	paddr_t slot;
+
+	KASSERT(vaddr >= MIPS_KSEG2 && vaddr % PAGE_SIZE == 0);
+	first = KVA_SLOT(vaddr);
+	KASSERT(first < KVA_NPAGES);
+
+	npages = kva_runlen[first];
+	if (npages == 0) {
+		panic("kfree: not a kernel virtual area: 0x%x\n", vaddr);
+	}
+
+	for (i=first; i<first+npages; i++) {
+		slot = kva_slots[i];
+		KASSERT(slot & KVA_MAPPED);
+		free_kpages(PADDR_TO_KVADDR(slot & PAGE_FRAME));
+	}
+
+	spinlock_acquire(&kva_lock);
+	for (i=first; i<first+npages; i++) {
+		kva_slots[i] = KVA_STALE;
+	}
+	kva_runlen[first] = 0;
+	kva_nstale += npages;
+	spinlock_release(&kva_lock);
+}
+
+/*
+ * Refill the TLB for a kernel access to FAULTADDRESS in kseg2.
+ * No lock is needed: the slot can't change while its owner, whose
+ * access this is, still has the area.
+ */
+int
+kva_fault(int faulttype, vaddr_t faultaddress)
+{
+	unsigned slot;
+	uint32_t ehi, elo;
+	int spl, i;
+
+	KASSERT(faultaddress >= MIPS_KSEG2);
+
+	slot = KVA_SLOT(faultaddress & PAGE_FRAME);
+	if (slot >= KVA_NPAGES || faulttype == VM_FAULT_READONLY) {
+		return EFAULT;
+	}
+	if ((kva_slots[slot] & KVA_MAPPED) == 0) {
+		return EFAULT;
+	}
+
+	vmstat_inc(VMSTAT_TLB_MISS);
+
+	ehi = faultaddress & PAGE_FRAME;
+	elo = (kva_slots[slot] & PAGE_FRAME) | TLBLO_DIRTY | TLBLO_VALID;
+
+	spl = splhigh();
+	i = tlb_probe(ehi, 0);
+	if (i >= 0) {
+		tlb_write(ehi, elo, i);
+	}
+	else {
+		tlb_random(ehi, elo);
+	}
+	splx(spl);
+
+	return 0;
+}
@@ -32,8 +32,10 @@
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
 #include <thread.h>
 #include <current.h>
+#include <wchan.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
@@ -41,9 +43,24 @@
 /* Wrap rma_stealmem in a spinlock. */
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 
+/* Heads of the buddy free lists, one per order. */
+static int free_lists[BUDDY_MAX_ORDER + 1];
+
+/* Page replacement: clock hand, and where to wait for busy pages. */
+static int clock_hand;
+static struct wchan *vm_busy_wchan;
+
 /* Declare static helper functions. */
 static void init_coremap_entry(int index, paddr_t pbase);
-static void zero_page(vaddr_t ptr);
+static void freelist_add(int index, int order);
+static void freelist_remove(int index);
+static int buddy_alloc(int order);
+static void buddy_free(int index, int order);
+static void buddy_free_range(int index, int n);
+static int pagecache_get(void);
+static void pagecache_put(int index);
+static int zeropool_get(void);
+static void vm_shootdown_pages(struct addrspace *as, struct coremap_entry **pages, int n);
 
 /*
  * Bootstrap OS/161 virtual memory system.
@@ -54,6 +71,7 @@ static void zero_page(vaddr_t ptr);
  */
 void vm_bootstrap() {
 	paddr_t lo, hi, free;
+	vaddr_t zero;
 	int j;
 	
 	/* Determine number of pages to allocate */
@@ -70,26 +88,60 @@ void vm_bootstrap() {
 	free = ROUNDUP(free, PAGE_SIZE);                            /* make sure coremap takes up a whole page or more */
 	free_start = free;                                          /* update global VM field */
 	npages -= (free - lo) / PAGE_SIZE;		                    /* subtract number of page(s) taken up from coremap */
-	nfreepages = npages;
+	nfreepages = 0;
 	spinlock_init(&coremap_lock);								/* Synchronization */
 	
+	for(j = 0; j <= BUDDY_MAX_ORDER; j++) {
+		free_lists[j] = -1;
+	}
+	
 	/* Initialize each page in the coremap */
 	for(j = 0; j < npages; j++) {
 		init_coremap_entry(j, free);
 		free += PAGE_SIZE;
 	}
 	
+	/* Hand all of physical memory to the buddy allocator */
+	buddy_free_range(0, npages);
+	
+	clock_hand = 0;
+	
 	vm_bootstrapped = true;
+	
+	/* kmalloc can now keep track of pages by coremap index */
+	kmalloc_bootstrap();
+	
+	vm_busy_wchan = wchan_create("vmbusy");
+	if(vm_busy_wchan == NULL) {
+		panic("vm: could not create busy page wchan\n");
+	}
+	
+	/* The shared zero page keeps a reference of its own forever */
+	zero = alloc_kpages(1);
+	if(zero == 0) {
+		panic("vm: could not allocate the zero page\n");
+	}
+	vm_zeropage = &coremap[get_coremap_index(zero)];
+	vm_zeropage->refcount = 1;
+	vm_zeropage->permissions = PAGE_READABLE;
+	vm_zeropage->state = PAGE_CLEAN;
 }
 
 static void init_coremap_entry(int index, paddr_t pbase) {
-		coremap[index].is_free = true;
+		coremap[index].is_free = false;
 		coremap[index].referenced = false;
+		coremap[index].refcount = 0;
+		coremap[index].is_shared = false;
 		coremap[index].vbase = PADDR_TO_KVADDR(pbase);
 		coremap[index].pbase = pbase;
-		coremap[index].cpuid = -1;
+		coremap[index].cpumask = 0;
+		coremap[index].text_vn = NULL;
+		coremap[index].text_next = -1;
 		coremap[index].is_permanent = false;
-		coremap[index].is_last = false;
+		coremap[index].chunk_npages = 0;
+		coremap[index].order = -1;
+		coremap[index].next_free = -1;
+		coremap[index].prev_free = -1;
 		coremap[index].is_locked = false;
 		spinlock_init(&coremap[index].lock);
 }
@@ -109,16 +161,306 @@ static paddr_t getppages(unsigned long npages)
 	return addr;
 }
 
+/*
+ * Buddy allocator internals. All of these must be called with
+ * coremap_lock held.
+ */
+
+/* Push the block of 2^ORDER pages headed by INDEX onto its free list. */
+static void freelist_add(int index, int order) {
+	coremap[index].order = order;
+	coremap[index].prev_free = -1;
+	coremap[index].next_free = free_lists[order];
+	if(free_lists[order] != -1) {
+		coremap[free_lists[order]].prev_free = index;
+	}
+	free_lists[order] = index;
+}
+
+/* Unlink the free block headed by INDEX from its free list. */
+static void freelist_remove(int index) {
+	int order = coremap[index].order;
+	
+	if(coremap[index].prev_free != -1) {
+		coremap[coremap[index].prev_free].next_free = coremap[index].next_free;
+	}
+	else {
+		free_lists[order] = coremap[index].next_free;
+	}
+	if(coremap[index].next_free != -1) {
+		coremap[coremap[index].next_free].prev_free = coremap[index].prev_free;
+	}
+	
+	coremap[index].order = -1;
+	coremap[index].next_free = -1;
+	coremap[index].prev_free = -1;
+}
+
+/*
+ * Take a free block of 2^ORDER pages, splitting a larger block if
+ * no block of exactly that order is free. Returns the index of the
+ * first page of the block, or -1 if there is no block big enough.
+ */
+static int buddy_alloc(int order) {
+	int o, index;
+	
+	for(o = order; o <= BUDDY_MAX_ORDER; o++) {
+		if(free_lists[o] != -1) {
+			break;
+		}
+	}
+	if(o > BUDDY_MAX_ORDER) {
+		return -1;
+	}
+	
+	index = free_lists[o];
+	freelist_remove(index);
+	
+	/* Give the upper halves back until the block is the right size */
+	while(o > order) {
+		o--;
+		freelist_add(index + (1 << o), o);
+	}
+	
+	return index;
+}
+
+/*
+ * Return the block of 2^ORDER pages starting at INDEX, merging it
+ * with its buddy for as long as the buddy is also free. The pages
+ * must already be marked free.
+ */
+static void buddy_free(int index, int order) {
+	int buddy;
+	
+	while(order < BUDDY_MAX_ORDER) {
+		buddy = index ^ (1 << order);
+		if(buddy + (1 << order) > npages) {
+			break;
+		}
+		if(!coremap[buddy].is_free || coremap[buddy].order != order) {
+			break;
+		}
+		freelist_remove(buddy);
+		if(buddy < index) {
+			index = buddy;
+		}
+		order++;
+	}
+	
+	freelist_add(index, order);
+}
+
+/*
+ * Free N pages starting at INDEX, carving the range into the largest
+ * naturally aligned blocks that fit.
+ */
+static void buddy_free_range(int index, int n) {
+	int i, order;
+	
+	for(i = index; i < index + n; i++) {
+		coremap[i].is_free = true;
+		coremap[i].referenced = false;
+		coremap[i].is_permanent = false;
+		coremap[i].chunk_npages = 0;
+		coremap[i].order = -1;
+		coremap[i].state = -1;
+		coremap[i].cpumask = 0;
+	}
+	nfreepages += n;
+	
+	while(n > 0) {
+		order = 0;
+		while(order < BUDDY_MAX_ORDER &&
+		      (index & ((1 << (order + 1)) - 1)) == 0 &&
+		      (1 << (order + 1)) <= n) {
+			order++;
+		}
+		buddy_free(index, order);
+		index += 1 << order;
+		n -= 1 << order;
+	}
+}
+
+/*
+ * Per-CPU page magazines.
+ *
+ * Single pages are allocated from and freed to a small stack of
+ * coremap indexes hung off the current cpu, so the common case never
+ * touches coremap_lock. Only when the magazine runs dry (or full) is
+ * the global lock taken, to move a batch of pages in (or out) at once.
+ *
+ * Pages sitting in a magazine are marked not free so the buddy
+ * allocator will not merge them, and are not counted in nfreepages;
+ * the pageout daemon adds them in through cpu_pooled_pages.
+ */
+
+/* Take a page out of this cpu's magazine, refilling it if empty. */
+static int pagecache_get(void) {
+	struct cpu *c;
+	int spl, i, index;
+	
+	spl = splhigh();
+	c = curcpu->c_self;
+	
+	if(c->c_npagecache == 0) {
+		if(!spinlock_do_i_hold(&coremap_lock)) {
+			spinlock_acquire(&coremap_lock);
+		}
+		
+		for(i = 0; i < CPU_PAGECACHE_BATCH; i++) {
+			index = buddy_alloc(0);
+			if(index == -1) {
+				break;
+			}
+			nfreepages--;
+			coremap[index].is_free = false;
+			c->c_pagecache[c->c_npagecache++] = index;
+		}
+		
+		if(spinlock_do_i_hold(&coremap_lock)) {
+			spinlock_release(&coremap_lock);
+		}
+		
+		/* Running low; get the pageout daemon going */
+		swap_pageout_wakeup();
+	}
+	
+	index = -1;
+	if(c->c_npagecache > 0) {
+		index = c->c_pagecache[--c->c_npagecache];
+	}
+	
+	splx(spl);
+	return index;
+}
+
+/* Put a page into this cpu's magazine, draining it first if full. */
+static void pagecache_put(int index) {
+	struct cpu *c;
+	int spl, i;
+	
+	coremap[index].referenced = false;
+	coremap[index].refcount = 0;
+	coremap[index].is_permanent = false;
+	coremap[index].chunk_npages = 0;
+	coremap[index].as = NULL;
+	coremap[index].state = -1;
+	coremap[index].cpumask = 0;
+	
+	spl = splhigh();
+	c = curcpu->c_self;
+	
+	if(c->c_npagecache == CPU_PAGECACHE_MAX) {
+		if(!spinlock_do_i_hold(&coremap_lock)) {
+			spinlock_acquire(&coremap_lock);
+		}
+		
+		for(i = 0; i < CPU_PAGECACHE_BATCH; i++) {
+			buddy_free_range(c->c_pagecache[--c->c_npagecache], 1);
+		}
+		
+		if(spinlock_do_i_hold(&coremap_lock)) {
+			spinlock_release(&coremap_lock);
+		}
+	}
+	
+	c->c_pagecache[c->c_npagecache++] = index;
+	splx(spl);
+}
+
+/*
+ * Take a page this cpu zeroed while idle, or -1 if there is none.
+ */
+static int zeropool_get(void) {
+	struct cpu *c;
+	int spl, index;
+	
+	spl = splhigh();
+	c = curcpu->c_self;
+	index = -1;
+	if(c->c_nzeropool > 0) {
+		index = c->c_zeropool[--c->c_nzeropool];
+	}
+	splx(spl);
+	
+	return index;
+}
+
+/*
+ * Zero one free page into this cpu's pool of zeroed pages. Called
+ * from the idle loop with interrupts off; returns false if there is
+ * nothing worth doing, so the cpu can go to sleep instead.
+ *
+ * Pages come out of this cpu's magazine if it has any, otherwise
+ * straight off the buddy free list. Memory that is running low is
+ * left alone for the pageout daemon to count.
+ *
+ * The zeroing itself runs with interrupts on, as cpu_idle would, so
+ * work handed to this cpu meanwhile isn't held up by it. The page is
+ * in neither the magazine nor the pool until it is done, so nothing
+ * else can get at it.
+ */
+bool vm_prezero_page(void) {
+	struct cpu *c;
+	int spl, index;
+	
+	if(!vm_bootstrapped || swap_memory_low()) {
+		return false;
+	}
+	
+	spl = splhigh();
+	c = curcpu->c_self;
+	
+	if(c->c_nzeropool == CPU_ZEROPOOL_MAX) {
+		splx(spl);
+		return false;
+	}
+	
+	if(c->c_npagecache > 0) {
+		index = c->c_pagecache[--c->c_npagecache];
+	}
+	else {
+		if(!spinlock_do_i_hold(&coremap_lock)) {
+			spinlock_acquire(&coremap_lock);
+		}
+		index = buddy_alloc(0);
+		if(index != -1) {
+			nfreepages--;
+			coremap[index].is_free = false;
+		}
+		if(spinlock_do_i_hold(&coremap_lock)) {
+			spinlock_release(&coremap_lock);
+		}
+		if(index == -1) {
+			splx(spl);
+			return false;
+		}
+	}
+	
+	cpu_irqon();
+	page_zero(coremap[index].vbase);
+	cpu_irqoff();
+	
+	/* Interrupt handlers may have taken pages, never added any */
+	c->c_zeropool[c->c_nzeropool++] = index;
+	
+	splx(spl);
+	return true;
+}
+
 /*
  * Allocate a contigous chunk of N kernel pages.
  *
  * A page being marked as a kernel page indicates that itoa
  * cannot be swapped out. Thus, kernel pages must be allocated
  * in contiguous chunks.
+ *
+ * The chunk is carved out of the smallest buddy block that holds it;
+ * any pages past N are handed straight back to the allocator.
  */
 vaddr_t alloc_kpages(int n) {
-	int i, start, end, match;
-	match = 0;
+	int i, start, order;
 	
 	KASSERT(n > 0);
 	
@@ -126,65 +468,128 @@ vaddr_t alloc_kpages(int n) {
 		return PADDR_TO_KVADDR(getppages(n));
 	}
 	
+	/* Single pages come from the per-cpu pools */
+	if(n == 1) {
+		start = zeropool_get();
+		if(start == -1) {
+			start = pagecache_get();
+			if(start == -1) {
+				return 0;
+			}
+			page_zero(coremap[start].vbase);
+		}
+		coremap[start].referenced = true;
+		coremap[start].is_permanent = true;
+		coremap[start].chunk_npages = 1;
+		return coremap[start].vbase;
+	}
+	
+	order = 0;
+	while((1 << order) < n) {
+		order++;
+	}
+	if(order > BUDDY_MAX_ORDER) {
+		return 0;
+	}
+	
 	if(!spinlock_do_i_hold(&coremap_lock)) {
 		spinlock_acquire(&coremap_lock);
 	}
 	
-	/* Find a chunk of N contiguous pages to allocate */
-	for(i = 0; i < npages; i++) {
-		if(coremap[i].is_free && match == 0) {
-			start = i;
-			match++;
-			if(n == match) {
-				end = i;
-				break;
-			}
-			continue;
-		}
-		if(coremap[i].is_free && match != n) {
-			match++;
-			if(n == match) {
-				end = i;
-				break;
-			}
-			continue;
-		}
-		if(!coremap[i].is_free && match != n) {
-			match = 0;
-		}
-		
-		if(match != n && i == npages-1) {
-			panic("could not allocate a contiguous block of %d pages", n);
+	start = buddy_alloc(order);
+	if(start == -1) {
+		/*
+		 * Kernel pages can't be evicted and we may not sleep
+		 * here, so fail the allocation (kmalloc returns NULL)
+		 * and let the pageout daemon make room for next time.
+		 */
+		if(spinlock_do_i_hold(&coremap_lock)) {
+			spinlock_release(&coremap_lock);
 		}
+		swap_pageout_wakeup();
+		return 0;
+	}
+	nfreepages -= 1 << order;
+	
+	/* Trim the block down to N pages */
+	if((1 << order) > n) {
+		buddy_free_range(start + n, (1 << order) - n);
 	}
 	
 	/* Update the state of the allocated page(s) before returning them */ 
-	for(i = start; i <= end; i++) {
+	for(i = start; i < start + n; i++) {
 		coremap[i].is_free = false;
 		coremap[i].referenced = true;
 		coremap[i].is_permanent = true;
-		if(i == end) {
-			coremap[i].is_last = true;
-		}
-		bzero((void *)coremap[i].vbase, PAGE_SIZE);
-		//zero_page(coremap[i].vbase);
-		nfreepages--;
-		// modify additional fields where necessary here 
+		// modify additional fields where necessary 
 	}
+	coremap[start].chunk_npages = n;
 	
 	if(spinlock_do_i_hold(&coremap_lock)) {
 		spinlock_release(&coremap_lock);
 	}
 	
+	/* The pages are ours now; zero them without holding up everyone else */
+	for(i = start; i < start + n; i++) {
+		page_zero(coremap[i].vbase);
+	}
+	
+	swap_pageout_wakeup();
+	
 	return coremap[start].vbase;
 }
 
-static void zero_page(vaddr_t vaddr) {
-	int i;
-	char *ptr;
-	ptr = (char *)vaddr;
-	for(i = 0; i < PAGE_SIZE; i++) {
-		*(ptr+i) = 0;
+/*
+ * Zero the page at kernel address VADDR a cache line (eight words)
+ * at a time. Pages are always aligned, so unlike bzero this never
+ * has odd bytes at either end to deal with.
+ */
+void page_zero(vaddr_t vaddr) {
+	uint32_t *ptr, *end;
+	
+	ptr = (uint32_t *)vaddr;
+	end = ptr + PAGE_SIZE / sizeof(uint32_t);
+	for(; ptr < end; ptr += 8) {
+		ptr[0] = 0;
+		ptr[1] = 0;
+		ptr[2] = 0;
+		ptr[3] = 0;
+		ptr[4] = 0;
+		ptr[5] = 0;
+		ptr[6] = 0;
+		ptr[7] = 0;
+	}
+}
+
+/*
+ * Copy the page at kernel address SRC to DST a cache line at a time,
+ * loading the whole line before storing any of it.
+ */
+void page_copy(vaddr_t dst, vaddr_t src) {
+	uint32_t *d, *end;
+	const uint32_t *s;
+	uint32_t w0, w1, w2, w3, w4, w5, w6, w7;
+	
+	d = (uint32_t *)dst;
+	s = (const uint32_t *)src;
+	end = d + PAGE_SIZE / sizeof(uint32_t);
+	for(; d < end; d += 8, s += 8) {
+		w0 = s[0];
+		w1 = s[1];
+		w2 = s[2];
+		w3 = s[3];
+		w4 = s[4];
+		w5 = s[5];
+		w6 = s[6];
+		w7 = s[7];
+		d[0] = w0;
+		d[1] = w1;
+		d[2] = w2;
+		d[3] = w3;
+		d[4] = w4;
+		d[5] = w5;
+		d[6] = w6;
+		d[7] = w7;
 	}
 }
 
@@ -192,63 +597,59 @@ static void zero_page(vaddr_t vaddr) {
  * Free a contiguous chunk of kernel pages.
  */
 void free_kpages(vaddr_t vaddr) {
-	int index, start, end;
+	int index;
 	
 	index = get_coremap_index(vaddr);
-	start = index;
-	end = index;
 	
 	if(index == -1) {
 		return;                    // An invalid vaddr was passed in, exit. 
 	}
 	
-	if(!spinlock_do_i_hold(&coremap_lock)) {
-		spinlock_acquire(&coremap_lock);
-	}
+	KASSERT(!coremap[index].is_free);
+	KASSERT(coremap[index].chunk_npages > 0);
 	
-	while(!coremap[index].is_last) {
-		spinlock_acquire(&coremap[index].lock);
-		
-		if(coremap[index].is_last) {
-			end = index;
-			break;
-		}
-		
-		spinlock_release(&coremap[index].lock);
-		
-		index++;	
+	if(coremap[index].chunk_npages == 1) {
+		pagecache_put(index);
+		return;
 	}
 	
-	for(index = start; index <= end; index++) {
-		spinlock_acquire(&coremap[index].lock);
-		
-		coremap[index].state = -1;
-		coremap[index].referenced = false;
-		coremap[index].is_free = true;
-		coremap[index].is_permanent = false;
-		coremap[index].is_last = false;	
-		// modify additional fields here where necessary	
-		spinlock_release(&coremap[index].lock);
-		
-		nfreepages++;
+	if(!spinlock_do_i_hold(&coremap_lock)) {
+		spinlock_acquire(&coremap_lock);
 	}
 	
+	buddy_free_range(index, coremap[index].chunk_npages);
+	
 	if(spinlock_do_i_hold(&coremap_lock)) {
 		spinlock_release(&coremap_lock);
 	}
 }
 
+/*
+ * Map a kernel virtual address back to its coremap index. Because the
+ * coremap covers physical memory linearly from free_start, this is
+ * plain arithmetic. Returns -1 for addresses outside the coremap
+ * (e.g. memory stolen before the VM system was bootstrapped).
+ */
 int get_coremap_index(vaddr_t vbase) {
-	int i;
+	paddr_t pbase;
+	int index;
 	
-	for(i = 0; i < npages; i++) {
-		if(coremap[i].vbase == vbase) {
-			return i;
-		}
+	if(vbase < MIPS_KSEG0 || vbase >= MIPS_KSEG1) {
+		return -1;
+	}
+	
+	pbase = KVADDR_TO_PADDR(vbase);
+	if(pbase < free_start) {
+		return -1;
+	}
+	
+	index = (pbase - free_start) / PAGE_SIZE;
+	if(index >= npages) {
+		//DEBUG(DB_VM, "could not find a coremap entry corresponding to virtual address 0x%08x\n", vbase);
+		return -1;
 	}
 
-	//DEBUG(DB_VM, "could not find a coremap entry corresponding to virtual address 0x%08x\n", vbase);
-	return -1;
+	return index;
 }
 
 /*
@@ -256,8 +657,7 @@ int get_coremap_index(vaddr_t vbase) {
  * contents in memory.
  */
 void copy_page(int src, int dst) {
-	int vsrc, vdst, i;
-	char *srcptr, *dstptr;
+	int vsrc, vdst;
 	
 	if(!spinlock_do_i_hold(&coremap_lock)) {
 		spinlock_acquire(&coremap_lock);
@@ -267,22 +667,17 @@ void copy_page(int src, int dst) {
 		spinlock_acquire(&coremap[dst].lock);
 		
 			/* Copy coremap entry information */
-			coremap[dst] = coremap[src];
+			coremap[dst].referenced = coremap[src].referenced;
+			coremap[dst].is_permanent = coremap[src].is_permanent;
+			coremap[dst].permissions = coremap[src].permissions;
+			coremap[dst].as = coremap[src].as;
+			coremap[dst].as_vbase = coremap[src].as_vbase;
+			coremap[dst].state = coremap[src].state;
 			vsrc = coremap[src].vbase;
 			vdst = coremap[dst].vbase;
 			
-			/* 
-			 * Copy memory contents from old page into new one.
-			 * We cast it to a char here because a char is a byte,
-			 * which allows us to copy a single byte at a time.
-			 * Thus the for loop only needs to loop PAGE_SIZE times
-			 * which is 4096 bytes.
-			 */
-			dstptr = (char *)vdst;
-			srcptr = (char *)vsrc;
-			for(i = 0; i < PAGE_SIZE; i++) {
-				dstptr[i] = srcptr[i];
-			}
+			/* Copy memory contents from old page into new one */
+			page_copy(vdst, vsrc);
 		
 		spinlock_release(&coremap[dst].lock);
 		spinlock_release(&coremap[src].lock);
@@ -296,43 +691,44 @@ void copy_page(int src, int dst) {
  * Allocate single page in the coremap.
  * Upon successful allocation, returns an index to the new page 
  * in the coremap. Otherwise returns -1.
+ *
+ * Single pages come out of the per-cpu magazine, which is refilled
+ * from the order-0 free list of the buddy allocator when empty. A
+ * page the cpu already zeroed while idle is preferred.
+ *
+ * If memory is exhausted, the caller evicts pages itself until one
+ * frees up, so this may sleep and must not be called with spinlocks
+ * held.
  */
  int alloc_page(void) {
 	int i;
 	
-	if(!spinlock_do_i_hold(&coremap_lock)) {
-		spinlock_acquire(&coremap_lock);
-	}
-	
-	for(i = 0; i < npages; i++) {
-		spinlock_acquire(&coremap[i].lock);
-		
-		if(coremap[i].is_free) {
-			coremap[i].is_free = false;
-			coremap[i].referenced = true;
-			coremap[i].is_permanent = false;
-			coremap[i].is_last = true;
-			zero_page(coremap[i].vbase);
-			// modify additional fields here where necessary
-			
-			spinlock_release(&coremap[i].lock);
-			if(spinlock_do_i_hold(&coremap_lock)) {
-				spinlock_release(&coremap_lock);
-			}
-			return i;
+	i = zeropool_get();
+	if(i == -1) {
+		i = pagecache_get();
+		while(i == -1 && vm_evict_page() == 0) {
+			i = pagecache_get();
 		}
-		spinlock_release(&coremap[i].lock);
+		if(i == -1) {
+			return -1;
+		}
+		page_zero(coremap[i].vbase);
 	}
 	
-	if(spinlock_do_i_hold(&coremap_lock)) {
-		spinlock_release(&coremap_lock);
-	}
+	coremap[i].referenced = true;
+	coremap[i].refcount = 1;
+	coremap[i].is_shared = false;
+	coremap[i].state = PAGE_DIRTY;
+	coremap[i].is_permanent = false;
+	coremap[i].chunk_npages = 1;
+	// modify additional fields here where necessary
 	
-	return -1;
+	return i;
  }
  
  /*
- * Free single page in the coremap.
+ * Drop a reference to a single page in the coremap, freeing it
+ * once nobody maps it any more.
  * Do not use this to free kernel pages that have been allocated
  * in a chunk, otherwise it will corrupt it. Use free_kpages instead.
  */
@@ -343,102 +739,557 @@ void free_page(vaddr_t addr) {
 				return ;			/* Not a valid page. */
 			}
 			
-			spinlock_acquire(&coremap[i].lock);
+			KASSERT(!coremap[i].is_free);
 			
-			coremap[i].is_free = true;
-			coremap[i].referenced = false;
-			coremap[i].is_permanent = false;
-			coremap[i].is_last = false;
-			// modify additional fields here where necessary	
+			if(coremap[i].text_vn != NULL) {
+				/* Shared text; the cache must see the last reference go */
+				if(textcache_release(&coremap[i])) {
+					pagecache_put(i);
+				}
+				return;
+			}
 			
+			spinlock_acquire(&coremap[i].lock);
+			KASSERT(coremap[i].refcount > 0);
+			coremap[i].refcount--;
+			if(coremap[i].refcount > 0) {
+				spinlock_release(&coremap[i].lock);
+				return;				/* Still shared. */
+			}
 			spinlock_release(&coremap[i].lock);
+			
+			pagecache_put(i);
 }
 	
-int vm_fault(int faulttype, vaddr_t faultaddress) {
+/*
+ * Wait until PAGE is no longer busy being evicted.
+ */
+void vm_wait_busy(struct coremap_entry *page) {
+	wchan_lock(vm_busy_wchan);
+	if(page->is_locked) {
+		wchan_sleep(vm_busy_wchan);
+	}
+	else {
+		wchan_unlock(vm_busy_wchan);
+	}
+}
+
+/*
+ * Make sure no CPU has a TLB entry for any of the N busy PAGES of AS.
+ * Only the CPUs that loaded one of them since it was allocated are
+ * interrupted, each once for the whole batch.
+ */
+static void vm_shootdown_pages(struct addrspace *as, struct coremap_entry **pages, int n) {
+	struct tlbshootdown ts[SWAP_CLUSTER_MAX];
+	uint32_t cpumask;
+	int i;
+	
+	KASSERT(n <= SWAP_CLUSTER_MAX);
+	
+	cpumask = 0;
+	for(i = 0; i < n; i++) {
+		/* Busy pages can't be loaded, so the mask can't grow */
+		spinlock_acquire(&pages[i]->lock);
+		cpumask |= pages[i]->cpumask;
+		pages[i]->cpumask = 0;
+		spinlock_release(&pages[i]->lock);
+		
+		ts[i].ts_addrspace = as;
+		ts[i].ts_vaddr = pages[i]->as_vbase;
+	}
+	
+	if(cpumask & ((uint32_t)1 << curcpu->c_number)) {
+		for(i = 0; i < n; i++) {
+			vm_tlbshootdown(&ts[i]);
+		}
+	}
+	ipi_tlbshootdown_mask(cpumask, ts, n);
+}
+
+/*
+ * Mark the page mapped at VADDR in AS busy, if it could go out to
+ * swap along with a neighbour being evicted: it must be a private,
+ * writable, dirty page that has not been used since the clock last
+ * passed it. Returns the page, or NULL.
+ */
+static struct coremap_entry *vm_busy_neighbour(struct addrspace *as, vaddr_t vaddr,
+                                               struct page_table_entry **ret) {
+	struct page_table_entry *entry;
+	struct coremap_entry *page;
+	bool ok;
+	
+	entry = pt_lookup(as->pages, vaddr);
+	if(entry == NULL || entry->page == NULL) {
+		return NULL;
+	}
+	page = entry->page;
+	
+	spinlock_acquire(&page->lock);
+	ok = !page->is_locked && page->as == as && page->as_vbase == vaddr &&
+	     page->refcount == 1 && !page->referenced &&
+	     (page->permissions & PAGE_WRITABLE) && page->state == PAGE_DIRTY;
+	if(ok) {
+		page->is_locked = true;
+	}
+	spinlock_release(&page->lock);
+	
+	if(!ok) {
+		return NULL;
+	}
+	*ret = entry;
+	return page;
+}
+
+/*
+ * Clear the busy mark on PAGE, leaving it mapped.
+ */
+static void vm_unbusy(struct coremap_entry *page) {
+	spinlock_acquire(&page->lock);
+	page->is_locked = false;
+	spinlock_release(&page->lock);
+}
+
+/*
+ * Unmap busy PAGE from ENTRY and free it. ON_DISK says whether its
+ * contents now live in ENTRY's swap slot.
+ */
+static void vm_evict_finish(struct page_table_entry *entry,
+                            struct coremap_entry *page, bool on_disk) {
+	if(page->state == PAGE_DIRTY) {
+		/* Remembered for writing a shared mapping back to its file */
+		entry->is_dirty = true;
+	}
+	entry->is_on_disk = on_disk;
+	entry->page = NULL;
+	
+	spinlock_acquire(&page->lock);
+	page->as = NULL;
+	page->is_locked = false;
+	spinlock_release(&page->lock);
+	
+	free_page(page->vbase);
+}
+
+/*
+ * Evict one user page, chosen by the clock (second chance)
+ * algorithm over the coremap. Pages of read-only regions are simply
+ * dropped, since as_load_page can rebuild them, as are clean pages
+ * whose swap slot still holds their contents. Pages shared
+ * copy-on-write are never chosen, because the coremap only knows one
+ * of their owners.
+ *
+ * A dirty victim is written out together with the cold, dirty pages
+ * on either side of it in its address space, up to SWAP_CLUSTER_MAX
+ * pages, in one transfer to consecutive swap slots. Slots are only
+ * assigned here, so swap space is used just by what is on disk.
+ *
+ * Returns 0 if at least one page was freed, or an error if nothing
+ * could be evicted. May sleep.
+ */
+int vm_evict_page(void) {
+	struct coremap_entry *pages[SWAP_CLUSTER_MAX];
+	struct page_table_entry *ptes[SWAP_CLUSTER_MAX];
+	paddr_t pas[SWAP_CLUSTER_MAX];
+	struct coremap_entry *page, *cm;
+	struct page_table_entry *entry;
+	struct addrspace *as;
+	vaddr_t vaddr;
+	off_t base;
+	int i, n, nback, victim;
+	
+	page = NULL;
+	
+	spinlock_acquire(&coremap_lock);
+	for(i = 0; i < 2 * npages; i++) {
+		cm = &coremap[clock_hand];
+		clock_hand = (clock_hand + 1) % npages;
+		
+		if(cm->is_free || cm->is_permanent || cm->as == NULL) {
+			continue;
+		}
+		
+		spinlock_acquire(&cm->lock);
+		if(cm->is_locked || cm->refcount != 1 || cm->as == NULL) {
+			spinlock_release(&cm->lock);
+			continue;
+		}
+		if(cm->referenced) {
+			/* Second chance */
+			cm->referenced = false;
+			spinlock_release(&cm->lock);
+			continue;
+		}
+		cm->is_locked = true;
+		spinlock_release(&cm->lock);
+		page = cm;
+		break;
+	}
+	spinlock_release(&coremap_lock);
+	
+	if(page == NULL) {
+		return ENOMEM;
+	}
+	
+	/*
+	 * The busy page pins its address space: as_destroy waits for
+	 * it before tearing down the page table.
+	 */
+	as = page->as;
+	vaddr = page->as_vbase;
+	entry = pt_lookup(as->pages, vaddr);
+	KASSERT(entry != NULL && entry->page == page);
+	
+	if(!(page->permissions & PAGE_WRITABLE) ||
+	   (page->state == PAGE_CLEAN && entry->disk_locale > 0)) {
+		/* Nothing to write; just make sure nobody can still use it */
+		vm_shootdown_pages(as, &page, 1);
+		vm_evict_finish(entry, page, (page->permissions & PAGE_WRITABLE) != 0);
+		wchan_wakeall(vm_busy_wchan);
+		return 0;
+	}
+	
+	/*
+	 * Gather the run of evictable pages around the victim, in
+	 * address order: first the ones below it, nearest first...
+	 */
+	nback = 0;
+	while(nback < SWAP_CLUSTER_MAX - 1 && vaddr >= (vaddr_t)(nback + 1) * PAGE_SIZE) {
+		pages[nback] = vm_busy_neighbour(as, vaddr - (nback + 1) * PAGE_SIZE,
+		                                 &ptes[nback]);
+		if(pages[nback] == NULL) {
+			break;
+		}
+		nback++;
+	}
+	for(i = 0; i < nback / 2; i++) {
+		cm = pages[i];
+		pages[i] = pages[nback - 1 - i];
+		pages[nback - 1 - i] = cm;
+		entry = ptes[i];
+		ptes[i] = ptes[nback - 1 - i];
+		ptes[nback - 1 - i] = entry;
+	}
+	
+	/* ...then the victim itself and the ones above it */
+	victim = nback;
+	pages[victim] = page;
+	ptes[victim] = pt_lookup(as->pages, vaddr);
+	n = victim + 1;
+	while(n < SWAP_CLUSTER_MAX) {
+		pages[n] = vm_busy_neighbour(as, vaddr + (n - victim) * PAGE_SIZE, &ptes[n]);
+		if(pages[n] == NULL) {
+			break;
+		}
+		n++;
+	}
+	
+	base = -1;
+	if(n > 1) {
+		base = swap_alloc_cluster(n);
+	}
+	if(base <= 0) {
+		/* No room for the whole run; write the victim on its own */
+		for(i = 0; i < n; i++) {
+			if(i != victim) {
+				vm_unbusy(pages[i]);
+			}
+		}
+		pages[0] = pages[victim];
+		ptes[0] = ptes[victim];
+		n = 1;
+		
+		base = ptes[0]->disk_locale;
+		if(base <= 0) {
+			base = swap_alloc();
+		}
+		if(base <= 0) {
+			/* Swap is full; leave this page where it is */
+			vm_unbusy(page);
+			wchan_wakeall(vm_busy_wchan);
+			return ENOSPC;
+		}
+	}
+	
+	/* Nobody may touch the pages through the TLB from here on */
+	vm_shootdown_pages(as, pages, n);
+	
+	for(i = 0; i < n; i++) {
+		/* A dirty page's old slot is stale now */
+		if(ptes[i]->disk_locale > 0 && ptes[i]->disk_locale != base + i * PAGE_SIZE) {
+			swap_free(ptes[i]->disk_locale);
+		}
+		ptes[i]->disk_locale = base + i * PAGE_SIZE;
+		pas[i] = pages[i]->pbase;
+	}
+	
+	swap_out_cluster(pas, n, base);
+	
+	for(i = 0; i < n; i++) {
+		vm_evict_finish(ptes[i], pages[i], true);
+	}
+	wchan_wakeall(vm_busy_wchan);
+	
+	return 0;
+}
+
+/*
+ * Load the mapping VADDR -> PAGE for AS into the TLB, replacing any
+ * entry already there for VADDR. ENTRY is the page table entry PAGE
+ * was found in. The page is only mapped writable if
+ * its region allows writes, it is not shared copy-on-write, and it
+ * is dirty; the first write to a clean page faults so it can be
+ * marked dirty. If DIRTY is set the page is marked dirty now.
+ *
+ * Returns EAGAIN if the page is busy being evicted, or ENTRY no longer
+ * maps it.
+ */
+static int vm_tlb_load(struct addrspace *as, vaddr_t vaddr,
+                       struct page_table_entry *entry,
+                       struct coremap_entry *page, bool dirty) {
 	int spl, i;
 	uint32_t hi, lo;
+	bool writable;
+	
+	spinlock_acquire(&page->lock);
+	if(page->is_locked || entry->page != page) {
+		spinlock_release(&page->lock);
+		return EAGAIN;
+	}
+	if(page->refcount == 1 && page->as == NULL) {
+		/* The other sharers are gone; the page is ours again */
+		page->as = as;
+		page->as_vbase = vaddr;
+	}
+	if(dirty) {
+		page->state = PAGE_DIRTY;
+	}
+	page->referenced = true;
+	page->cpumask |= (uint32_t)1 << curcpu->c_number;
+	writable = (page->permissions & PAGE_WRITABLE) &&
+	           (page->refcount == 1 || page->is_shared) &&
+	           page->state == PAGE_DIRTY;
+	
+	/* 
+	 * Generate a TLB Hi entry according to the below format
+	 * as defined by the MIPS architecture.
+	 * -----------------------------------------------------
+	 * |       VPN        |     PID     |     RESERVED     |
+	 * -----------------------------------------------------
+	 * 31               12  11          8  7               0
+	 *
+	 * Here, VPN is the upper 20 bits of the virtual address that
+	 * the user program accessed which caused the TLB fault. 
+	 * The PID bits represent the process ID of the process to which
+	 * this TLB entry belongs to.
+	 */
+	hi = vaddr & PAGE_FRAME;
+	
+	/* 
+	 * Generate a TLB Lo entry according to the below format
+	 * as defined by the MIPS architecture.
+	 * -----------------------------------------------------
+	 * |       PPN        |     MODE     |     RESERVED    |
+	 * -----------------------------------------------------
+	 * 31               12  11          8  7               0
+	 *
+	 * Here, PPN is the the pbase of the corresponding page
+	 * in the coremap.
+	 * The MODE bits set READ/WRITE/EXECUTION permissions, and should
+	 * match the permissions previously set in the coremap entry. 
+	 */
+	lo = page->pbase | TLBLO_VALID;
+	if(writable) {
+		lo |= TLBLO_DIRTY;
+	}
+	
+	/*
+	 * Keep holding the page lock until the entry is in: an evictor
+	 * that marks the page busy after this will shoot it down.
+	 */
+	spl = splhigh();
+	
+	/* Replace the existing entry for this page, if there is one */
+	i = tlb_probe(hi, 0);
+	if(i < 0) {
+		/* Walk through TLB and find an open slot */
+		for (i=0; i<NUM_TLB; i++) {
+			uint32_t ehi, elo;
+			tlb_read(&ehi, &elo, i);
+			if (!(elo & TLBLO_VALID)) {
+				break;
+			}
+		}
+	}
+	DEBUG(DB_VM, "vm: 0x%08x -> 0x%08x; hi=0x%08x lo=0x%08x\n", vaddr, page->pbase, hi, lo);
+	if(i < NUM_TLB) {
+		tlb_write(hi, lo, i);
+	}
+	else {
+		/* TLB is full; let the hardware pick a victim */
+		tlb_random(hi, lo);
+	}
+	
+	splx(spl);
+	spinlock_release(&page->lock);
+	return 0;
+}
+
+/*
+ * Give ENTRY a private copy of its page, which is shared
+ * copy-on-write with at least one other address space. If every
+ * other sharer has already let go of it, or it is a MAP_SHARED page
+ * that everyone writes in place, the page is simply kept.
+ */
+static int vm_copy_on_write(struct addrspace *as, vaddr_t vaddr,
+                            struct page_table_entry *entry) {
+	struct coremap_entry *old;
+	int index;
+	
+	old = entry->page;
+	
+	spinlock_acquire(&old->lock);
+	if(old->refcount == 1 || old->is_shared) {
+		spinlock_release(&old->lock);
+		return 0;
+	}
+	/* Hold an extra reference so the page can't go away under us */
+	old->refcount++;
+	spinlock_release(&old->lock);
+	
+	index = alloc_page();
+	if(index == -1) {
+		free_page(old->vbase);
+		return ENOMEM;
+	}
+	
+	page_copy(coremap[index].vbase, old->vbase);
+	vmstat_inc(VMSTAT_COW);
+	coremap[index].permissions = old->permissions;
+	
+	entry->page = &coremap[index];
+	
+	/*
+	 * Our TLB entry is replaced when the new page is loaded, but
+	 * another cpu this address space ran on may still map the old
+	 * one.
+	 */
+	cpu_forget_addrspace(as);
 	
-	vaddr_t lowerbound, upperbound;
+	spinlock_acquire(&coremap[index].lock);
+	coremap[index].as = as;
+	coremap[index].as_vbase = vaddr;
+	spinlock_release(&coremap[index].lock);
+	
+	/* Drop our extra reference, and our mapping's */
+	spinlock_acquire(&old->lock);
+	if(old->as == as) {
+		old->as = NULL;
+	}
+	spinlock_release(&old->lock);
+	free_page(old->vbase);
+	free_page(old->vbase);
+	
+	return 0;
+}
+
+int vm_fault(int faulttype, vaddr_t faultaddress) {
+	int result;
+	
+	struct addrspace *as;
 	struct page_table_entry *entry;
+	struct coremap_entry *page;
+	
+	faultaddress &= PAGE_FRAME;
+	
+	if(faultaddress >= MIPS_KSEG2) {
+		/* Large kmalloc area */
+		return kva_fault(faulttype, faultaddress);
+	}
+	
+	as = curthread->t_addrspace;
+	if(as == NULL) {
+		return EFAULT;
+	}
+	
+	switch(faulttype) {
+	    case VM_FAULT_READ:
+			vmstat_inc(VMSTAT_FAULT_READ);
+			break;
+	    case VM_FAULT_WRITE:
+			vmstat_inc(VMSTAT_FAULT_WRITE);
+			break;
+	    case VM_FAULT_READONLY:
+			vmstat_inc(VMSTAT_FAULT_READONLY);
+			break;
+	}
+	
+ retry:
+	/* O(1) lookup in the two-level page table */
+	entry = pt_lookup(as->pages, faultaddress);
 	
 	switch(faulttype) {
 	    case VM_FAULT_READ:  // 0
 		
 			
 	    case VM_FAULT_WRITE: // 1
-			entry = curthread->t_addrspace->pages->firstentry;
-			while(entry != NULL) {
-				if(entry->page == NULL) {
-					entry = entry->next;
-					continue;
-				}
-				
-				lowerbound = (entry->page->as_vbase);
-				upperbound = lowerbound + PAGE_SIZE;
-					if(faultaddress < upperbound && faultaddress >= lowerbound) { 
-					   /*  
-					    * This is the page we are looking for. Now, update the TLB with the proper virtual
-						* to physical address mapping, i.e. (entry->page->vbase) --> (entry->page->pbase)
-						*/
-						spl = splhigh();
-						
-						/* Walk through TLB and find an open slot */
-						for (i=0; i<NUM_TLB; i++) {
-							tlb_read(&hi, &lo, i);
-							if (lo & TLBLO_VALID) {
-								continue;
-							}
-							
-							/* 
-							 * Generate a TLB Hi entry according to the below format
-							 * as defined by the MIPS architecture.
-							 * -----------------------------------------------------
-							 * |       VPN        |     PID     |     RESERVED     |
-							 * -----------------------------------------------------
-							 * 31               12  11          8  7               0
-							 *
-							 * Here, VPN is the upper 20 bits of the virtual address that
-							 * the user program accessed which caused the TLB fault. 
-							 * The PID bits represent the process ID of the process to which
-							 * this TLB entry belongs to.
-							 */
-							 hi = faultaddress & 0xFFFFF000;
-							
-							/* 
-							 * Generate a TLB Lo entry according to the below format
-							 * as defined by the MIPS architecture.
-							 * -----------------------------------------------------
-							 * |       PPN        |     MODE     |     RESERVED    |
-							 * -----------------------------------------------------
-							 * 31               12  11          8  7               0
-							 *
-							 * Here, PPN is the the pbase of the corresponding page
-							 * in the coremap.
-							 * The MODE bits set READ/WRITE/EXECUTION permissions, and should
-							 * match the permissions previously set in the coremap entry. 
-							 */
-							 lo = entry->page->pbase | TLBLO_DIRTY | TLBLO_VALID; // Mark each entry as valid and writable for now.
-							
-							DEBUG(DB_VM, "vm: 0x%08x -> 0x%08x; hi=0x%08x lo=0x%08x\n", faultaddress, entry->page->pbase, hi, lo);
-							tlb_write(hi, lo, i);
-							splx(spl);
-							return 0;
-						}
-						//tlb_random(hi, lo);
-						splx(spl);
-						return 0;
-					}
-					entry = entry->next;
-				}
-			//thread_exit();
 	    case VM_FAULT_READONLY: // 2
+			if(entry == NULL || entry->page == NULL ||
+			   (faulttype != VM_FAULT_READ && entry->page == vm_zeropage)) {
+				/*
+				 * First touch, or the page was evicted: zero-fill
+				 * it, read it in from the file, or swap it in. A
+				 * write to the shared zero page gets a page of its
+				 * own here too.
+				 */
+				result = as_load_page(as, faultaddress,
+				                      faulttype != VM_FAULT_READ, &entry);
+				if(result) {
+					return result;
+				}
+			}
+			else if(faulttype != VM_FAULT_READONLY) {
+				/* Resident; only the TLB entry was missing */
+				vmstat_inc(VMSTAT_TLB_MISS);
+			}
+			
+			/* The pageout daemon may have taken it again already */
+			page = entry->page;
+			if(page == NULL) {
+				goto retry;
+			}
+			
+			if(faulttype == VM_FAULT_READ) {
+				break;
+			}
+			
+			if(!(page->permissions & PAGE_WRITABLE)) {
 				// Kill thread for violating access permissions.
-			return 0;
+				return EFAULT;
+			}
+			
+			/* Write to a copy-on-write page */
+			result = vm_copy_on_write(as, faultaddress, entry);
+			if(result) {
+				return result;
+			}
+			page = entry->page;
+			if(page == NULL) {
+				goto retry;
+			}
+			break;
 	    default:
 			return EINVAL;	
 	}
 	
-	return 0;
+	result = vm_tlb_load(as, faultaddress, entry, page,
+	                     faulttype != VM_FAULT_READ);
+	if(result == EAGAIN) {
+		/* Being evicted; wait, then look again */
+		vm_wait_busy(page);
+		goto retry;
+	}
+	
+	return result;
 }
 
 
@@ -450,6 +1301,22 @@ void vm_tlbshootdown_all(void) {
 	}
 
 }
+
+/*
+ * Invalidate this CPU's TLB entry for the page in T, if it has one.
+ */
 void vm_tlbshootdown(const struct tlbshootdown *t) {
-	(void)t;
+	int spl, i;
+	
+	spl = splhigh();
+	if(curcpu->c_lastas != NULL && curcpu->c_lastas != t->ts_addrspace) {
+		/* Flushed when that address space was switched out */
+		splx(spl);
+		return;
+	}
+	i = tlb_probe(t->ts_vaddr & PAGE_FRAME, 0);
+	if(i >= 0) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	splx(spl);
 }
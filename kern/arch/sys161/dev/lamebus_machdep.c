@@ -242,6 +242,19 @@ mainbus_send_ipi(struct cpu *target)
 	lamebus_assert_ipi(lamebus, target);
 }
 
+/*
+ * Stop or restart the on-chip timer that drives hardclock on the
+ * current cpu. There is no way to turn it off, so stopping it just
+ * pushes the next interrupt as far off as it will go (a few minutes);
+ * if that ever arrives, hardclock copes and the timer carries on at
+ * HZ.
+ */
+void
+mainbus_hardclock_enable(bool enable)
+{
+	mips_timer_set(enable ? CPU_FREQUENCY / HZ : 0xffffffff);
+}
+
 /*
  * Interrupt dispatcher.
  */
@@ -837,13 +837,17 @@ emufs_namefile(struct vnode *v, struct uio *uio)
 
 /*
  * VOP_MMAP
+ *
+ * The VM pages mapped files in and out through VOP_READ and
+ * VOP_WRITE, so all we need to say is that files may be mapped.
+ * (Directories use emufs_void_op_isdir instead.)
  */
 static
 int
 emufs_mmap(struct vnode *v)
 {
 	(void)v;
-	return EUNIMP;
+	return 0;
 }
 
 //////////////////////////////
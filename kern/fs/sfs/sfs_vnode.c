@@ -1110,14 +1110,16 @@ sfs_fsync(struct vnode *v)
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). The VM pages mapped files in and out through
+ * VOP_READ and VOP_WRITE, so all we need to say is that files may be
+ * mapped. (Directories get ISDIR instead.)
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v)
 {
 	(void)v;
-	return EUNIMP;
+	return 0;
 }
 
 /*
@@ -59,8 +59,8 @@ struct addrspace {
         paddr_t as_stackpbase;
 #else
     	struct page_table *pages;   /* Page table */
-	struct page *heap_page;		/* Page mapped to heap region */
 	struct region_list *regions;
+	struct region *heap_region;		/* Region grown and shrunk by sbrk */
 	vaddr_t heap_start;			/* Heap start point */
 	vaddr_t heap_end;			/* Heap end point */ 
 	int n_heap_pages;			/* Number of heap pages */
@@ -69,20 +69,44 @@ struct addrspace {
 
 /*
  * Page table
+ *
+ * Two-level radix table indexed by virtual page number. The top ten
+ * bits of a user address select a slot in the directory, the next ten
+ * bits select an entry in the second-level table hanging off that
+ * slot. Second-level tables are allocated the first time a page in
+ * their 4MB span is added, so lookup and insert are both O(1).
+ *
+ * Only kuseg is mapped through the page table, so the directory only
+ * needs enough slots to cover USERSPACETOP.
  */
+#define PT_L1_SHIFT	22
+#define PT_L2_SHIFT	12
+#define PT_L1_ENTRIES	(USERSPACETOP >> PT_L1_SHIFT)
+#define PT_L2_ENTRIES	1024
+
+#define PT_L1_INDEX(va)	((va) >> PT_L1_SHIFT)
+#define PT_L2_INDEX(va)	(((va) >> PT_L2_SHIFT) & (PT_L2_ENTRIES - 1))
+#define PT_VADDR(l1, l2) \
+	(((vaddr_t)(l1) << PT_L1_SHIFT) | ((vaddr_t)(l2) << PT_L2_SHIFT))
+
 struct page_table {
-	struct page_table_entry *firstentry;
+	struct page_table_entry **pt_dir[PT_L1_ENTRIES];
 };
 
 struct page_table_entry {
-	struct page_table_entry *next;		/* Next page table entry */
-	struct page_table_entry *prev;		/* Previous page table entry */
 	struct coremap_entry *page;			/* Index of page in coremap */
 	bool is_on_disk;
 	off_t disk_locale;
+	bool is_dirty;				/* Written since last synced to its file */
 };
 
 
+/*
+ * Size of the user stack region. Stack pages, like all other pages,
+ * are only allocated when first touched.
+ */
+#define USERSTACK_NPAGES 256
+
 /*
  * Region list 
  */
@@ -90,16 +114,49 @@ struct region_list {
 	struct region *firstregion;
 };
 
+/*
+ * Region flags. Regions made by mmap may be unmapped again, and read
+ * past the end of their file as zeroes. Writes to a MAP_SHARED region
+ * are written back to its file on munmap, fsync and exit, and its
+ * pages are shared with forked children rather than copied. The heap
+ * is a single zero-fill region that sbrk resizes in place.
+ */
+#define REGION_MMAP	0x1
+#define REGION_SHARED	0x2
+#define REGION_HEAP	0x4
+
 struct region {
 	vaddr_t vaddr;
 	size_t npages;
 	int permissions;
+	int flags;				/* REGION_* */
+	struct vnode *vn;			/* Backing file, or NULL if zero-fill */
+	off_t file_offset;			/* File offset of the byte at file_vaddr */
+	vaddr_t file_vaddr;			/* Where the file contents start */
+	size_t file_size;			/* Bytes read from the file; the rest is zero-fill */
 	struct region *next;
 };
 
 
-struct page_table_entry *add_pte(struct addrspace *as, struct coremap_entry *page);
+struct page_table *pt_create(void);
+void pt_destroy(struct page_table *pt);
+struct page_table_entry *pt_lookup(struct page_table *pt, vaddr_t vaddr);
+int pt_insert(struct page_table *pt, vaddr_t vaddr, struct page_table_entry *pte);
+
+struct page_table_entry *add_pte(struct addrspace *as, vaddr_t vaddr, struct coremap_entry *page);
 int add_region(struct addrspace *as, vaddr_t vaddr, int npages, int permissions);
+struct region *region_find(struct addrspace *as, vaddr_t vaddr);
+int as_define_backing(struct addrspace *as, vaddr_t vaddr, struct vnode *v,
+                      off_t offset, size_t filesize);
+int as_load_page(struct addrspace *as, vaddr_t vaddr, bool write,
+                 struct page_table_entry **ret);
+
+/* mmap support */
+int as_mmap(struct addrspace *as, vaddr_t vaddr, size_t len, int permissions,
+            int flags, struct vnode *vn, off_t offset, vaddr_t *ret);
+int as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len);
+int as_sync_vnode(struct addrspace *as, struct vnode *vn);
+int as_set_break(struct addrspace *as, vaddr_t brk);
 /*
  * Functions in addrspace.c:
  *
@@ -121,13 +178,35 @@ int add_region(struct addrspace *as, vaddr_t vaddr, int npages, int permissions)
  *                the way this works if implementing user-level threads.
  *
  *    as_define_region - set up a region of memory within the address
- *                space.
+ *                space. Only the region is recorded; its pages are
+ *                materialized by vm_fault the first time they are
+ *                touched.
+ *
+ *    as_define_backing - attach the file contents that the region
+ *                containing VADDR should be filled with on demand.
+ *
+ *    as_load_page - allocate and fill the page containing VADDR from
+ *                the regions that cover it, or map the shared zero
+ *                page for a read of a page that is all zeroes.
+ *                Called by vm_fault.
+ *
+ *    as_mmap   - add a region for mmap, anonymous or backed by VN,
+ *                at VADDR or wherever there is room if VADDR is 0.
+ *
+ *    as_munmap - remove the mmap regions in a range, writing shared
+ *                file mappings back first.
+ *
+ *    as_sync_vnode - write back every shared mapping of VN (fsync).
+ *
+ *    as_set_break - move the end of the heap to BRK, freeing any
+ *                pages no longer covered (sbrk).
  *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
  *    as_complete_load - this is called when loading from an executable
- *                is complete.
+ *                is complete. Places the (empty) heap after the
+ *                loaded segments.
  *
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
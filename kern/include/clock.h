@@ -36,7 +36,8 @@
  * Time-related definitions.
  *
  * hardclock() is called on every CPU HZ times a second, possibly only
- * when the CPU is not idle, for scheduling.
+ * when the CPU is not idle, for scheduling. (On System/161 the timer
+ * is stopped while a CPU idles; see thread_switch.)
  *
  * timerclock() is called on one CPU once a second to allow simple
  * timed operations. (This is a fairly simpleminded interface.)
@@ -56,6 +57,20 @@
 #define HZ  100
 #endif
 
+/*
+ * Scheduler timing, in hardclocks. These may be changed at run time
+ * (see the "sched" menu command) and must stay nonzero.
+ *
+ * sched_quantum is how long a thread runs before it is preempted in
+ * favour of another runnable thread; the feedback queue scheduler
+ * doubles it at each level down. schedule() and
+ * thread_consider_migration() are run every schedule_hardclocks and
+ * migrate_hardclocks respectively.
+ */
+extern unsigned sched_quantum;
+extern unsigned schedule_hardclocks;
+extern unsigned migrate_hardclocks;
+
 void hardclock_bootstrap(void);
 
 void hardclock(void);
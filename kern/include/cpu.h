@@ -46,6 +46,18 @@
  * a pointer with a fixed address and a per-cpu mapping in the MMU.
  */
 
+/*
+ * Size of the per-cpu free page magazine, and how many pages move
+ * between it and the global allocator at once.
+ */
+#define CPU_PAGECACHE_MAX	16
+#define CPU_PAGECACHE_BATCH	8
+
+/* Most free pages a cpu zeroes ahead of time while idle. */
+#define CPU_ZEROPOOL_MAX	16
+
+struct addrspace;
+
 struct cpu {
 	/*
 	 * Fixed after allocation.
@@ -61,6 +73,48 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 *
+	 * Magazine of free physical pages (coremap indexes) that
+	 * alloc_page() and friends hand out without taking
+	 * coremap_lock. It is refilled from, and drained to, the
+	 * global allocator CPU_PAGECACHE_BATCH pages at a time.
+	 */
+	int c_pagecache[CPU_PAGECACHE_MAX];
+	int c_npagecache;
+
+	/*
+	 * Free pages this cpu zeroed while it had nothing else to do
+	 * (see vm_prezero_page). alloc_page() and alloc_kpages(1)
+	 * take these first, so they needn't zero on the spot.
+	 */
+	int c_zeropool[CPU_ZEROPOOL_MAX];
+	int c_nzeropool;
+
+	/*
+	 * Written by this cpu with interrupts off; other cpus only
+	 * ever clear it (see cpu_forget_addrspace).
+	 *
+	 * The address space whose mappings this cpu's TLB may hold, or
+	 * NULL if it may hold anything. as_activate skips flushing the
+	 * TLB when the incoming thread runs in this address space.
+	 */
+	struct addrspace *c_lastas;
+
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 *
+	 * A thread that yielded here but may not run here any more
+	 * (see thread_setaffinity). It can't be put on another cpu's
+	 * run queue until we are off its stack, so the thread that
+	 * runs next sends it on. If there is nothing else to run, that
+	 * is c_idlethread, which is never on any run queue and only
+	 * runs to idle on a stack of its own.
+	 */
+	struct thread *c_migrant;
+	struct thread *c_idlethread;
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
@@ -69,6 +123,15 @@ struct cpu {
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
 	struct spinlock c_runqueue_lock;
 
+	/*
+	 * Accessed by other cpus.
+	 * Written with the runqueue lock held, read without it.
+	 *
+	 * Length of the run queue, so other cpus can compare loads
+	 * without taking every runqueue lock. Only a hint.
+	 */
+	volatile unsigned c_nrunnable;
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the IPI lock.
@@ -86,6 +149,7 @@ struct cpu {
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	volatile unsigned c_shootdowns_done; /* Bumped per batch processed */
 	struct spinlock c_ipi_lock;
 };
 
@@ -139,6 +203,19 @@ void cpu_irqon(void);
 void cpu_idle(void);
 void cpu_halt(void);
 
+/*
+ * Make every other cpu flush its TLB the next time it activates AS,
+ * because AS's mappings have changed in a way their TLBs may not
+ * have seen, or AS is about to be freed.
+ */
+void cpu_forget_addrspace(struct addrspace *as);
+
+/*
+ * Count the free pages parked in every cpu's page magazine and zero
+ * pool. They are read without locks, so this is only a hint.
+ */
+unsigned cpu_pooled_pages(void);
+
 /*
  * Interprocessor interrupts.
  *
@@ -152,6 +229,12 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_mask sends a batch of N shootdowns to each CPU
+ * whose number is set in CPUMASK (other than the current one), one
+ * IPI per CPU, and waits until each of them has processed it. More
+ * than TLBSHOOTDOWN_MAX pending entries turn into a full flush, as
+ * does passing NULL for MAPPINGS. It must be called with interrupts
+ * enabled.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -166,6 +249,8 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_mask(uint32_t cpumask,
+			   const struct tlbshootdown *mappings, unsigned n);
 
 void interprocessor_interrupt(void);
 
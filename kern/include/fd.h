@@ -49,4 +49,12 @@ struct fd {
 	bool readable;
 };
 
+/*
+ * Get a file handle with nothing open in it, readable and writable,
+ * and give one back. Handles come from an object cache that keeps
+ * each one's lock, so the lock must not be held or replaced.
+ */
+struct fd *fd_create(void);
+void fd_destroy(struct fd *fd);
+
 #endif /* _FD_H_ */
@@ -197,6 +197,10 @@
 #define SYS_reboot       119
 //#define SYS___sysctl   120
 
+//                              -- Scheduling --
+#define SYS_sched_setaffinity 121
+#define SYS_sched_getaffinity 122
+
 /*CALLEND*/
 
 
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KMEM_CACHE_H_
+#define _KMEM_CACHE_H_
+
+/*
+ * Object caches.
+ *
+ * A kmem_cache hands out objects of one type, and keeps freed ones
+ * in their constructed state so that the next allocation is just a
+ * pop off a per-cpu stack. The constructor runs only when an object
+ * is first made out of kmalloc'd memory, and the destructor only when
+ * the cache is holding as many free objects as it wants and gives one
+ * back to kmalloc. So objects must be handed back constructed: locks
+ * not held, wait channels empty, and so on.
+ *
+ * The constructor returns 0 or an error code; either hook may be
+ * NULL. Caches are statically allocated with KMEM_CACHE_INITIALIZER,
+ * and can be used from the very start of boot.
+ */
+
+#include <spinlock.h>
+#include <platform/maxcpus.h>
+
+#define KMEM_CACHE_DEPTH 8	/* free objects kept per cpu */
+#define KMEM_CACHE_DEPOT 32	/* and in the shared depot */
+
+struct kmem_cache_cpu {
+	unsigned kcc_count;
+	void *kcc_objs[KMEM_CACHE_DEPTH];
+};
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+	struct spinlock kc_lock;	/* protects the depot */
+	unsigned kc_ndepot;
+	void *kc_depot[KMEM_CACHE_DEPOT];
+	struct kmem_cache_cpu kc_cpus[MAXCPUS];
+};
+
+#define KMEM_CACHE_INITIALIZER(name, size, ctor, dtor) \
+	{ name, size, ctor, dtor, SPINLOCK_INITIALIZER, 0, { NULL }, \
+	  { { 0, { NULL } } } }
+
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+
+#endif /* _KMEM_CACHE_H_ */
@@ -126,6 +126,7 @@ uint32_t random(void);
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
+void kmalloc_bootstrap(void);
 
 /*
  * C string functions. 
@@ -144,6 +145,7 @@ char *strtok_r(char *buf, const char *seps, char **context);
 
 void *memcpy(void *dest, const void *src, size_t len);
 void *memmove(void *dest, const void *src, size_t len);
+void *memset(void *ptr, int ch, size_t len);
 void bzero(void *ptr, size_t len);
 int atoi(const char *str);
 
@@ -55,6 +55,9 @@ size_t mainbus_ramsize(void);
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
+/* Stop or restart hardclock() on the current cpu. (Interrupts off.) */
+void mainbus_hardclock_enable(bool enable);
+
 /*
  * The various ways to shut down the system. (These are very low-level
  * and should generally not be called directly - md_poweroff, for
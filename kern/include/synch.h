@@ -71,14 +71,20 @@ void V(struct semaphore *);
  *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
+ *
+ * This is an adaptive mutex: an uncontended acquire or release is a
+ * single atomic operation on lk_word, and a thread that finds the
+ * lock held spins while the holder is running on another cpu, and
+ * only sleeps once it isn't. lk_wlock guards only the count of
+ * sleepers, and is not touched unless there are some.
  */
 struct lock {
         char *lk_name;
-		struct semaphore *lk_sem;
-		struct thread *lk_holder;
-		volatile bool lk_acquired;
-        // add what you need here
-        // (don't forget to mark things volatile as needed)
+	volatile spinlock_data_t lk_word;	/* 1 while held */
+	struct thread *volatile lk_holder;
+	struct spinlock lk_wlock;		/* for lk_nsleepers */
+	volatile unsigned lk_nsleepers;
+	struct wchan *lk_wchan;
 };
 
 struct lock *lock_create(const char *name);
@@ -144,23 +150,28 @@ void cv_broadcast(struct cv *cv, struct lock *lock);
 
 /*
  * 13 Feb 2012 : GWA : Reader-writer locks.
+ *
+ * The whole state is one word, rwlock_state: the number of readers
+ * holding the lock, and flag bits for a writer holding it and for
+ * writers waiting. Taking and dropping the lock is a compare-and-swap
+ * on that word, so readers run concurrently without sharing any other
+ * lock. Waiting writers shut out new readers (writer preference), and
+ * a writer leaving hands off to the next writer if there is one, or
+ * else lets in all waiting readers at once.
+ *
+ * rwlock_wlock only guards the waiter counts and going to sleep, and
+ * is only taken when somebody has to wait.
  */
 
 struct rwlock {
         char *rwlock_name;
-		
-		struct lock *rwlock_lock;
-		
-		struct cv *rwlock_read_cv;
-		struct cv *rwlock_write_cv;
-		struct cv *rwlock_cv;
-		
-		volatile int rwlock_reader_count;
-		volatile int rwlock_rqueue;
-		volatile int rwlock_wqueue;	
-		
-		volatile bool rwlock_read;
-		volatile bool rwlock_write;
+	volatile spinlock_data_t rwlock_state;
+	struct thread *volatile rwlock_writer;	/* for assertions */
+	struct spinlock rwlock_wlock;
+	unsigned rwlock_nreadwait;		/* readers asleep */
+	unsigned rwlock_nwritewait;		/* writers waiting */
+	struct wchan *rwlock_readwchan;
+	struct wchan *rwlock_writewchan;
 };
 
 struct rwlock * rwlock_create(const char *);
@@ -59,6 +59,7 @@ off_t sys_lseek(int fd, off_t pos, int whence, int *errcode);
 int sys_dup2(int oldfs, int newfd, int *errcode);
 int sys_chdir(const_userptr_t path, int *errcode);
 int sys__getcwd(userptr_t buf, size_t buflen, int *errcode);
+int sys_fsync(int fd, int *errcode);
 
 /* Process related system calls */
 int sys_execv(userptr_t program, char **args, int *errcode);
@@ -66,7 +67,12 @@ int sys_waitpid(pid_t pid, userptr_t status, int options, int *errcode);
 pid_t sys_fork(struct trapframe *tf, int *errcode);
 pid_t sys_getpid(void);
 void sys__exit(int code);
-void * sys_sbrk(int inc);
+void * sys_sbrk(int inc, int *errcode);
+void * sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+                off_t offset, int *errcode);
+int sys_munmap(userptr_t addr, size_t len, int *errcode);
+int sys_sched_setaffinity(pid_t pid, unsigned mask, int *errcode);
+int sys_sched_getaffinity(pid_t pid, userptr_t mask, int *errcode);
 pid_t menu_wait(pid_t pid);
 void sys_execv_thread(void *ptr, unsigned long nargs);
 
@@ -90,6 +90,13 @@ struct thread {
 	struct fd* t_fd_table[OPEN_MAX];
 	pid_t t_pid;
 
+	/* Scheduling; see schedule() in thread.c */
+	int t_priority;			/* Feedback queue level, 0 highest */
+	unsigned t_ticks;		/* Hardclocks used at this level */
+	unsigned t_epoch;		/* Priority boost last seen */
+	uint32_t t_cpumask;		/* Cpus it may run on, by c_number */
+	unsigned t_lastran;		/* t_cpu's c_hardclocks when it last ran */
+
 	/*
 	 * Interrupt state fields.
 	 *
@@ -176,11 +183,31 @@ void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Restrict the current thread to the cpus in MASK (bit N is the cpu
+ * with c_number N), moving it if need be. Children made by
+ * thread_fork inherit the mask. Returns EINVAL if MASK names no cpu
+ * that exists.
+ */
+int thread_setaffinity(uint32_t mask);
+
+/*
+ * Charge a clock tick to the current thread. Returns true if it
+ * should yield. Called from the timer interrupt.
+ */
+bool thread_tick(void);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
 void schedule(void);
 
+/*
+ * Scheduler work that isn't per-cpu. Called once a second from
+ * timerclock().
+ */
+void schedule_timerclock(void);
+
 /*
  * Potentially migrate ready threads to other CPUs. Called from the
  * timer interrupt.
@@ -46,6 +46,8 @@
  * VM system-related definitions.
  */
  
+struct vnode;
+
 /* Coremap entry */
 struct coremap_entry {
 	/* Syncrhonization */
@@ -54,30 +56,71 @@ struct coremap_entry {
 	
 	/* Page Management */
 	bool referenced;                /* Is this page referenced? */
+	int refcount;					/* Number of page table entries mapping this page */
+	bool is_shared;					/* MAP_SHARED by several address spaces; never copied */
 	paddr_t pbase;					/* Base physical address of page */
 	vaddr_t vbase;					/* Base virtual address of page */
 	bool is_free;					/* Is the page free? */
 	bool is_permanent;				/* Can the page be swapped out? */
-	bool is_last;					/* Is the page the last one in a chunk? */
+	int chunk_npages;				/* Pages in the chunk this page heads, if allocated */
 	int permissions;				/* Permission flags */
 	
+	/* Buddy Allocator Fields */
+	int order;						/* Order of the free block this page heads, else -1 */
+	int next_free;					/* Next free block of the same order, else -1 */
+	int prev_free;					/* Previous free block of the same order, else -1 */
+	
 	/* TLB Management Fields */
 	struct addrspace *as;			/* Corresponding address space that page belongs to */
 	vaddr_t as_vbase;				/* Base virtual address in address space */
-	int cpuid;						/* CPU where TLB entry resides */
+	uint32_t cpumask;				/* CPUs that may have it in their TLB */
 	int state;                      /* Current state of page (dirty, clean, etc.) */
+	
+	/* Shared Text Cache Fields (see vm/textcache.c) */
+	struct vnode *text_vn;			/* File the page was read from, if cached */
+	off_t text_offset;				/* File offset of the start of the page */
+	unsigned text_len;				/* Bytes of the page that came from the file */
+	int text_next;					/* Next page in the same hash bucket, else -1 */
 };
 
+/*
+ * Page states. A clean page has an up-to-date copy in its swap slot
+ * (or can be rebuilt from its region) and can be evicted without
+ * being written out. A dirty page must be written to swap first.
+ *
+ * is_locked marks a page as busy: it is being evicted, and must not
+ * be mapped, shared or freed until the evictor is done with it. Use
+ * vm_wait_busy to wait for that.
+ */
+#define PAGE_CLEAN 0
+#define PAGE_DIRTY 1
+
 /* Coremap structure */
 struct coremap_entry *coremap;
 
 /* Coremap synchronization */
 struct spinlock coremap_lock;
 
+/*
+ * Free memory is managed by a binary buddy allocator. Free blocks of
+ * 2^order pages are kept on one free list per order, threaded through
+ * the coremap entries that head them. Order-0 blocks are the single
+ * page free list used by alloc_page().
+ */
+#define BUDDY_MAX_ORDER 16
+
+/*
+ * Most pages moved to or from swap in one transfer. Eviction writes
+ * runs of virtually adjacent dirty pages to consecutive slots, and a
+ * swap-in fault reads back the neighbours stored next to the page.
+ */
+#define SWAP_CLUSTER_MAX 8
+
 /* Global VM system fields */
 int npages;                          /* Number of pages on system. */
 int nfreepages;
 bool vm_bootstrapped;                /* Is the VM system bootstrapped? */
+struct coremap_entry *vm_zeropage;   /* Shared read-only page of zeroes */
 paddr_t free_start;                  /* Pointer to first page's location in physical memory */
 
 #include <machine/vm.h>
@@ -98,12 +141,39 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
-/* Single page utility functions */
+/* Kernel memory mapped in kseg2, for large kmallocs (see kva.c) */
+vaddr_t kva_alloc(unsigned long npages);
+void kva_free(vaddr_t vaddr);
+int kva_fault(int faulttype, vaddr_t faultaddress);
+
+/*
+ * Single page utility functions.
+ *
+ * User pages are reference counted, since copy-on-write lets several
+ * address spaces map the same page. alloc_page returns a page with
+ * one reference; free_page drops one and frees the page when the
+ * last one goes away.
+ *
+ * Untouched zero-fill pages that are only read all map vm_zeropage,
+ * which holds a reference of its own so it is never freed. The first
+ * write replaces it with a private page.
+ */
 int alloc_page(void);
 void free_page(vaddr_t addr);
 void copy_page(int src, int dst);
 int get_coremap_index(vaddr_t vbase);
 
+/* Zero or copy a whole page, by kernel address */
+void page_zero(vaddr_t vaddr);
+void page_copy(vaddr_t dst, vaddr_t src);
+
+/* Zero a free page ahead of time; called by idle cpus */
+bool vm_prezero_page(void);
+
+/* Page replacement */
+int vm_evict_page(void);
+void vm_wait_busy(struct coremap_entry *page);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *t);
@@ -111,9 +181,42 @@ void vm_tlbshootdown(const struct tlbshootdown *t);
 /* Swapping */
 void swap_bootstrap(void);
 off_t swap_alloc(void);
+off_t swap_alloc_cluster(unsigned n);
 void swap_free(off_t swap_addr);
 void swap_to_mem(paddr_t pa, off_t swap_addr);
 void swap_to_disk(paddr_t pa, off_t swap_addr);
+void swap_in_cluster(const paddr_t *pas, unsigned n, off_t swap_addr);
+void swap_out_cluster(const paddr_t *pas, unsigned n, off_t swap_addr);
+void swap_pageout_wakeup(void);
+bool swap_memory_low(void);
+
+/* Shared read-only text pages */
+struct coremap_entry *textcache_lookup(struct vnode *vn, off_t offset,
+                                       unsigned len, int permissions);
+struct coremap_entry *textcache_insert(struct coremap_entry *page,
+                                       struct vnode *vn, off_t offset,
+                                       unsigned len);
+bool textcache_release(struct coremap_entry *page);
+
+/*
+ * VM statistics (see vm/vmstat.c). Counters are kept per cpu and
+ * summed when the report is printed or read from the vmstat: device.
+ */
+#define VMSTAT_TLB_MISS		0	/* TLB miss on a resident page */
+#define VMSTAT_FAULT_READ	1	/* vm_fault by type */
+#define VMSTAT_FAULT_WRITE	2
+#define VMSTAT_FAULT_READONLY	3
+#define VMSTAT_ZEROPAGE		4	/* Read mapped the shared zero page */
+#define VMSTAT_ZEROFILL		5	/* Private page zero-filled on fault */
+#define VMSTAT_COW		6	/* Copy-on-write page copy */
+#define VMSTAT_SWAPIN		7	/* Pages read from swap */
+#define VMSTAT_SWAPOUT		8	/* Pages written to swap */
+#define VMSTAT_NCOUNTERS	9
+
+void vmstat_bootstrap(void);
+void vmstat_add(unsigned which, unsigned n);
+void vmstat_print(void);
+#define vmstat_inc(which) vmstat_add(which, 1)
 
 
 #endif /* _VM_H_ */
@@ -133,6 +133,7 @@ boot(void)
 	/* Late phase of initialization. */
 	vm_bootstrap();
 	swap_bootstrap();
+	vmstat_bootstrap();
 	kprintf_bootstrap();
 	thread_start_cpus();
 
@@ -38,6 +38,7 @@
 #include <thread.h>
 #include <synch.h>
 #include <vfs.h>
+#include <vm.h>
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
@@ -385,6 +386,52 @@ cmd_bootfs(int nargs, char **args)
 	return vfs_setbootfs(device);
 }
 
+/*
+ * Command for showing and setting the scheduler timing parameters.
+ */
+static
+int
+cmd_sched(int nargs, char **args)
+{
+	unsigned *param;
+	int val;
+
+	if (nargs == 1) {
+		kprintf("quantum %u, schedule %u, migrate %u (hardclocks)\n",
+			sched_quantum, schedule_hardclocks,
+			migrate_hardclocks);
+		return 0;
+	}
+
+	if (nargs != 3) {
+		kprintf("Usage: sched [quantum|schedule|migrate ticks]\n");
+		return EINVAL;
+	}
+
+	if (!strcmp(args[1], "quantum")) {
+		param = &sched_quantum;
+	}
+	else if (!strcmp(args[1], "schedule")) {
+		param = &schedule_hardclocks;
+	}
+	else if (!strcmp(args[1], "migrate")) {
+		param = &migrate_hardclocks;
+	}
+	else {
+		kprintf("sched: no parameter %s\n", args[1]);
+		return EINVAL;
+	}
+
+	val = atoi(args[2]);
+	if (val <= 0) {
+		kprintf("sched: %s must be at least 1\n", args[1]);
+		return EINVAL;
+	}
+	*param = val;
+
+	return 0;
+}
+
 static
 int
 cmd_kheapstats(int nargs, char **args)
@@ -397,6 +444,18 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vmstat_print();
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -436,6 +495,7 @@ static const char *opsmenu[] = {
 	"[cd]      Change directory          ",
 	"[pwd]     Print current directory   ",
 	"[sync]    Sync filesystems          ",
+	"[sched]   Scheduler timing          ",
 	"[panic]   Intentional panic         ",
 	"[q]       Quit and shut down        ",
 	NULL
@@ -467,6 +527,7 @@ static const char *testmenu[] = {
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
 	"[sy5] CV test 2             (1)     ",
+	"[rwt] Rwlock test/benchmark (1)     ",
 	"[sp1] Whalematching Driver  (1)     ",
 	"[sp2] Stoplight Driver      (1)     ",
 	"[fs1] Filesystem test               ",
@@ -498,6 +559,7 @@ static const char *mainmenu[] = {
 	"[?o] Operations menu                ",
 	"[?t] Tests menu                     ",
 	"[kh] Kernel heap stats              ",
+	"[vm] Virtual memory stats           ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -538,6 +600,7 @@ static struct {
 	{ "cd",		cmd_chdir },
 	{ "pwd",	cmd_pwd },
 	{ "sync",	cmd_sync },
+	{ "sched",	cmd_sched },
 	{ "panic",	cmd_panic },
 	{ "q",		cmd_quit },
 	{ "exit",	cmd_quit },
@@ -546,6 +609,7 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "vm",		cmd_vmstats },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -564,6 +628,7 @@ static struct {
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
 	{ "sy5",	cvtest2 },
+	{ "rwt",	rwtest },
 	
 #if OPT_SYNCHPROBS
   /* synchronization problem tests */
@@ -42,6 +42,63 @@
 #include <kern/errno.h>
 #include <stat.h>
 #include <kern/seek.h>
+#include <addrspace.h>
+#include <fd.h>
+#include <kmem_cache.h>
+
+/*
+ * File handles are cached with their lock already created.
+ */
+static
+int
+fd_ctor(void *obj)
+{
+	struct fd *fd = obj;
+
+	fd->lock = lock_create("fd");
+	if(fd->lock == NULL) {
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static
+void
+fd_dtor(void *obj)
+{
+	struct fd *fd = obj;
+
+	lock_destroy(fd->lock);
+}
+
+static struct kmem_cache fd_cache =
+	KMEM_CACHE_INITIALIZER("fd", sizeof(struct fd), fd_ctor, fd_dtor);
+
+struct fd *
+fd_create(void) {
+	struct fd *fd;
+
+	fd = kmem_cache_alloc(&fd_cache);
+	if(fd == NULL) {
+		return NULL;
+	}
+	fd->flags = 0;
+	fd->offset = 0;
+	fd->ref_count = 0;
+	fd->vn = NULL;
+	fd->writable = true;
+	fd->readable = true;
+	return fd;
+}
+
+void
+fd_destroy(struct fd *fd) {
+	if(fd == NULL) {
+		return;
+	}
+	KASSERT(!lock_do_i_hold(fd->lock));
+	kmem_cache_free(&fd_cache, fd);
+}
 
 int 
 sys_open(const_userptr_t path, int flags, int mode, int *errcode) {
@@ -108,7 +165,6 @@ sys_open(const_userptr_t path, int flags, int mode, int *errcode) {
 	}
 	
 	curthread->t_fd_table[fd]->ref_count = 1;
-	curthread->t_fd_table[fd]->lock = lock_create(pathname);
 	curthread->t_fd_table[fd]->vn = v;
 	
 	/* Set whether the file descriptor should be in
@@ -136,20 +192,21 @@ sys_open(const_userptr_t path, int flags, int mode, int *errcode) {
 	return fd;
 }
 
+/*
+ * Reads and writes go through a kernel buffer of at most IO_STAGE_SIZE
+ * bytes, a chunk at a time, so however much the user asks for, one
+ * call never ties up more than a page of kernel memory.
+ */
+#define IO_STAGE_SIZE PAGE_SIZE
+
 int
 sys_read(int fd, userptr_t buf, size_t buflen, int *errcode) {
 	/* Initialize some stuff */
 	struct uio read;
 	struct iovec iov;
 	int err;
-	char kbuf[buflen];
-	
-	/* Copy in data from user space pointer to kernel buffer */
-	err = copyin(buf, &kbuf, buflen);
-	if(err) {
-		(*errcode) = EFAULT;
-		return -1;
-	}
+	char *kbuf;
+	size_t done, len, got;
 	
 	/* Error checking */
 	if(fd < 0 || fd >= OPEN_MAX || (curthread->t_fd_table[fd]->vn == NULL)) {
@@ -162,26 +219,49 @@ sys_read(int fd, userptr_t buf, size_t buflen, int *errcode) {
 		return -1;
 	}
 	
-	/* Do the read */
+	kbuf = kmalloc(buflen < IO_STAGE_SIZE ? buflen : IO_STAGE_SIZE);
+	if(kbuf == NULL) {
+		(*errcode) = ENOMEM;
+		return -1;
+	}
+	
+	/* Do the read, and send each chunk back to the user's buffer */
+	err = 0;
+	done = 0;
 	lock_acquire(curthread->t_fd_table[fd]->lock);
-		uio_kinit(&iov, &read, &kbuf, buflen, curthread->t_fd_table[fd]->offset, UIO_READ);
-		err = VOP_READ(curthread->t_fd_table[fd]->vn, &read);
-		if(err) {
-			(*errcode) = err;
-			return -1;
+		while(done < buflen) {
+			len = buflen - done;
+			if(len > IO_STAGE_SIZE) {
+				len = IO_STAGE_SIZE;
+			}
+			uio_kinit(&iov, &read, kbuf, len, curthread->t_fd_table[fd]->offset, UIO_READ);
+			err = VOP_READ(curthread->t_fd_table[fd]->vn, &read);
+			if(err) {
+				break;
+			}
+			got = len - read.uio_resid;
+			err = copyout(kbuf, (userptr_t)((vaddr_t)buf + done), got);
+			if(err) {
+				err = EFAULT;
+				break;
+			}
+			curthread->t_fd_table[fd]->offset += got;
+			done += got;
+			if(got < len) {
+				/* End of file, or all the device had */
+				break;
+			}
 		}
-		
-		curthread->t_fd_table[fd]->offset += (buflen - read.uio_resid);
 	lock_release(curthread->t_fd_table[fd]->lock);
+	kfree(kbuf);
 	
-	/* Send data back to user's buffer */
-	err = copyout(&kbuf, buf, buflen);
-	if(err) {
-		(*errcode) = EFAULT;
+	/* Report what got through, if anything did */
+	if(err && done == 0) {
+		(*errcode) = err;
 		return -1;
 	}
 	
-	return buflen - read.uio_resid;
+	return done;
 }
 
 int
@@ -190,14 +270,8 @@ sys_write(int fd, const_userptr_t buf, size_t nbytes, int *errcode) {
 	struct uio write;
 	struct iovec iov;
 	int err;
-	char kbuf[nbytes];
-	
-	/* Copy in data from user space pointer to kernel buffer */
-	err = copyin(buf, &kbuf, nbytes);
-	if(err) {
-		(*errcode) = EFAULT;
-		return -1;
-	}
+	char *kbuf;
+	size_t done, len, put;
 	
 	/* Error checking */
 	if((fd < 0) || fd >= OPEN_MAX || (curthread->t_fd_table[fd]->vn == NULL) || (fd >= OPEN_MAX)) {
@@ -210,21 +284,51 @@ sys_write(int fd, const_userptr_t buf, size_t nbytes, int *errcode) {
 		return -1;
 	}
 	
-	/* Do the write */
+	kbuf = kmalloc(nbytes < IO_STAGE_SIZE ? nbytes : IO_STAGE_SIZE);
+	if(kbuf == NULL) {
+		(*errcode) = ENOMEM;
+		return -1;
+	}
+	
+	/* Copy in and write out a chunk at a time */
+	err = 0;
+	done = 0;
 	lock_acquire(curthread->t_fd_table[fd]->lock);
-		uio_kinit(&iov, &write, &kbuf, nbytes, curthread->t_fd_table[fd]->offset, UIO_WRITE);
-		err = VOP_WRITE(curthread->t_fd_table[fd]->vn, &write);
-		if(err) {
-			(*errcode) = err;
-			return -1;
+		while(done < nbytes) {
+			len = nbytes - done;
+			if(len > IO_STAGE_SIZE) {
+				len = IO_STAGE_SIZE;
+			}
+			err = copyin((const_userptr_t)((vaddr_t)buf + done), kbuf, len);
+			if(err) {
+				err = EFAULT;
+				break;
+			}
+			uio_kinit(&iov, &write, kbuf, len, curthread->t_fd_table[fd]->offset, UIO_WRITE);
+			err = VOP_WRITE(curthread->t_fd_table[fd]->vn, &write);
+			if(err) {
+				break;
+			}
+			put = len - write.uio_resid;
+			curthread->t_fd_table[fd]->offset += put;
+			done += put;
+			if(put < len) {
+				/* Out of space */
+				break;
+			}
 		}
 	lock_release(curthread->t_fd_table[fd]->lock);
+	kfree(kbuf);
 	
-	curthread->t_fd_table[fd]->offset += (nbytes - write.uio_resid);
-	return nbytes - write.uio_resid;
+	/* Report what got through, if anything did */
+	if(err && done == 0) {
+		(*errcode) = err;
+		return -1;
+	}
+	
+	return done;
 }
 
-
 int
 sys_close(int fd, int *errcode) {
 	/* Error checking */
@@ -271,7 +375,6 @@ sys_dup2(int oldfd, int newfd, int *errcode) {
 	}
 
 	curthread->t_fd_table[newfd]->vn = curthread->t_fd_table[oldfd]->vn;
-	curthread->t_fd_table[newfd]->lock = curthread->t_fd_table[oldfd]->lock;
 	curthread->t_fd_table[newfd]->writable = curthread->t_fd_table[oldfd]->writable;
 	curthread->t_fd_table[newfd]->readable = curthread->t_fd_table[oldfd]->readable;
 	curthread->t_fd_table[newfd]->flags = curthread->t_fd_table[oldfd]->flags;
@@ -396,3 +499,34 @@ sys_lseek(int fd, off_t pos, int whence, int *errcode) {
 	
 	return newpos;
 }
+
+/*
+ * fsync: write back any shared mappings of the file in this process,
+ * then have the file system flush it.
+ */
+int
+sys_fsync(int fd, int *errcode) {
+	struct vnode *vn;
+	int err;
+	
+	if(fd < 0 || fd >= OPEN_MAX || (curthread->t_fd_table[fd]->vn == NULL)) {
+		(*errcode) = EBADF;
+		return -1;
+	}
+	vn = curthread->t_fd_table[fd]->vn;
+	
+	if(curthread->t_addrspace != NULL) {
+		err = as_sync_vnode(curthread->t_addrspace, vn);
+		if(err) {
+			(*errcode) = err;
+			return -1;
+		}
+	}
+	
+	err = VOP_FSYNC(vn);
+	if(err) {
+		(*errcode) = err;
+		return -1;
+	}
+	return 0;
+}
@@ -45,6 +45,7 @@
 #include <thread.h>
 #include <process.h>
 #include <kern/wait.h>
+#include <kern/mman.h>
 #include <mips/trapframe.h>
 #include <addrspace.h>
 #include <test.h>
@@ -243,71 +244,174 @@ void sys_execv_thread(void *ptr, unsigned long nargs) {
 
 }
 
-void * sys_sbrk(int inc) {
+/*
+ * sbrk: move the end of the heap by INC bytes and return the old
+ * end. The heap pages are only allocated when touched, and a
+ * negative INC gives the pages past the new end back right away.
+ */
+void * sys_sbrk(int inc, int *errcode) {
 	struct addrspace *as = curthread->t_addrspace;
+	vaddr_t oldbreak;
+	int err;
 	
-	KASSERT(as->heap_end + inc >= as->heap_start);
-	
-	if(as->n_heap_pages == 0 && inc == 0) {
-			struct region *cur = as->regions->firstregion;
-			struct region *prev;
-			
-			while(cur != NULL) {
-				if(cur->next == NULL) {
-					break;
-				}
-				prev = cur;
-				cur = cur->next;
-			}
-			
-			as->heap_start = ROUNDUP(prev->vaddr + (prev->npages * PAGE_SIZE) + 1, PAGE_SIZE);
-			as->heap_end = as->heap_start;
-			as->n_heap_pages = 24;
-			
-			as_define_region(as, as->heap_start, 
-			24 * PAGE_SIZE, PAGE_READABLE, PAGE_WRITABLE, 0);
-
-			return (void *)as->heap_start;
-	}
+	oldbreak = as->heap_end;
 	
-	if(inc == 0) {
-		return (void *)as->heap_end;
+	if(inc < 0 && (vaddr_t)0 - (vaddr_t)inc > oldbreak - as->heap_start) {
+		(*errcode) = EINVAL;
+		return (void *)-1;
+	}
+	if(inc > 0 && oldbreak + inc < oldbreak) {
+		(*errcode) = ENOMEM;
+		return (void *)-1;
 	}
 	
-	if(as->heap_end + inc <= as->heap_start + (as->n_heap_pages * PAGE_SIZE)) {
-		vaddr_t oldbreak;
-		oldbreak = as->heap_end;
-		as->heap_end += inc;
-		return (void *)oldbreak;
+	err = as_set_break(as, oldbreak + inc);
+	if(err) {
+		(*errcode) = err;
+		return (void *)-1;
 	}
 	
-	vaddr_t oldbreak;
-	oldbreak = as->heap_end;
-	as_define_region(as, as->heap_end + 1, 
-	ROUNDUP(inc,PAGE_SIZE), PAGE_READABLE, PAGE_WRITABLE, 0);
-	as->n_heap_pages += ROUNDUP(inc,PAGE_SIZE);
-	as->heap_end += inc;
 	return (void *)oldbreak;
+}
+
+/*
+ * mmap: map LEN bytes of the file open on FD from OFFSET, or zeroed
+ * memory if MAP_ANON is set, with protection PROT. With MAP_FIXED the
+ * mapping goes at ADDR, which must not already be in use; otherwise
+ * the kernel picks the address and ADDR is ignored. Pages are only
+ * read in as they are touched.
+ *
+ * MAP_SHARED writes are written back to the file on munmap, fsync
+ * and exit. They are not seen by other processes mapping the same
+ * file before then, except for forked children, which share the
+ * parent's MAP_SHARED pages (anonymous ones too) instead of getting
+ * copy-on-write copies.
+ */
+void *
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+         off_t offset, int *errcode)
+{
+	struct addrspace *as = curthread->t_addrspace;
+	struct vnode *vn;
+	vaddr_t vaddr;
+	int permissions, regionflags, err;
 	
-	/*
-	if(as->heap_end + inc >= as->heap_end) {
-		if(as->heap_end + inc <= as->heap_start + (as->n_heap_pages * PAGE_SIZE) ) {
-			// Just increment the heap end point.
-			as->heap_end += inc;	
-			return (void *)as->heap_end;
+	/* Exactly one of MAP_SHARED and MAP_PRIVATE */
+	if(len == 0 || ((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0)) {
+		(*errcode) = EINVAL;
+		return (void *)-1;
+	}
+	if((flags & MAP_FIXED) && (addr == NULL || ((vaddr_t)addr & ~PAGE_FRAME) != 0)) {
+		(*errcode) = EINVAL;
+		return (void *)-1;
+	}
+	
+	permissions = 0;
+	if(prot & PROT_READ) {
+		permissions |= PAGE_READABLE;
+	}
+	if(prot & PROT_WRITE) {
+		permissions |= PAGE_WRITABLE;
+	}
+	if(prot & PROT_EXEC) {
+		permissions |= PAGE_EXECUTABLE;
+	}
+	
+	vn = NULL;
+	regionflags = 0;
+	if(!(flags & MAP_ANON)) {
+		if(offset < 0 || (offset & ~(off_t)PAGE_FRAME) != 0) {
+			(*errcode) = EINVAL;
+			return (void *)-1;
 		}
-		else {
-			as_define_region(as, as->heap_start + (as->n_heap_pages * PAGE_SIZE), 
-			inc, PAGE_READABLE, PAGE_WRITABLE, 0);	
-			as->heap_end += inc;
-			as->n_heap_pages += ROUNDUP(inc, PAGE_SIZE);
-			return (void *)as->heap_end;			
+		if(fd < 0 || fd >= OPEN_MAX || (curthread->t_fd_table[fd]->vn == NULL)) {
+			(*errcode) = EBADF;
+			return (void *)-1;
 		}
+		if(!curthread->t_fd_table[fd]->readable ||
+		   ((flags & MAP_SHARED) && (prot & PROT_WRITE) &&
+		    !curthread->t_fd_table[fd]->writable)) {
+			(*errcode) = EACCES;
+			return (void *)-1;
+		}
+		vn = curthread->t_fd_table[fd]->vn;
+		
+		/* Only regular files can be mapped */
+		err = VOP_MMAP(vn);
+		if(err) {
+			(*errcode) = ENODEV;
+			return (void *)-1;
+		}
+	}
+	if(flags & MAP_SHARED) {
+		regionflags |= REGION_SHARED;
+	}
 	
-	}*/
-		 
-	//as->heap_end += ROUNDUP(as->heap_end + inc, 4);
-	//as->heap_end += inc;
-	//return (void *)as->heap_end;
+	err = as_mmap(as, (flags & MAP_FIXED) ? (vaddr_t)addr : 0, len,
+	              permissions, regionflags, vn, offset, &vaddr);
+	if(err) {
+		(*errcode) = err;
+		return (void *)-1;
+	}
+	
+	return (void *)vaddr;
+}
+
+int
+sys_munmap(userptr_t addr, size_t len, int *errcode)
+{
+	int err;
+	
+	err = as_munmap(curthread->t_addrspace, (vaddr_t)addr, len);
+	if(err) {
+		(*errcode) = err;
+		return -1;
+	}
+	return 0;
 }
 
+/*
+ * Restrict the calling process to the cpus whose bits are set in
+ * MASK. A process may only set its own affinity (PID 0 means the
+ * caller).
+ */
+int
+sys_sched_setaffinity(pid_t pid, unsigned mask, int *errcode)
+{
+	int err;
+	
+	if(pid != 0 && pid != curthread->t_pid) {
+		(*errcode) = ESRCH;
+		return -1;
+	}
+	
+	err = thread_setaffinity(mask);
+	if(err) {
+		(*errcode) = err;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Copy out the calling process's cpu affinity mask.
+ */
+int
+sys_sched_getaffinity(pid_t pid, userptr_t mask, int *errcode)
+{
+	unsigned kmask;
+	int err;
+	
+	if(pid != 0 && pid != curthread->t_pid) {
+		(*errcode) = ESRCH;
+		return -1;
+	}
+	
+	kmask = curthread->t_cpumask;
+	err = copyout(&kmask, mask, sizeof(kmask));
+	if(err) {
+		(*errcode) = err;
+		return -1;
+	}
+	return 0;
+}
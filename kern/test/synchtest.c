@@ -33,6 +33,7 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spinlock.h>
 #include <clock.h>
 #include <thread.h>
 #include <synch.h>
@@ -42,6 +43,10 @@
 #define NLOCKLOOPS    120
 #define NCVLOOPS      5
 #define NTHREADS      32
+#define NRWLOOPS      100
+#define NRWWORK       2000	/* reads of the data per read section */
+#define NRWREADERS    8
+#define NRWWRITERS    2
 
 static volatile unsigned long testval1;
 static volatile unsigned long testval2;
@@ -49,6 +54,7 @@ static volatile unsigned long testval3;
 static struct semaphore *testsem;
 static struct lock *testlock;
 static struct cv *testcv;
+static struct rwlock *testrwlock;
 static struct semaphore *donesem;
 
 static
@@ -73,6 +79,12 @@ inititems(void)
 			panic("synchtest: cv_create failed\n");
 		}
 	}
+	if (testrwlock==NULL) {
+		testrwlock = rwlock_create("testrwlock");
+		if (testrwlock == NULL) {
+			panic("synchtest: rwlock_create failed\n");
+		}
+	}
 	if (donesem==NULL) {
 		donesem = sem_create("donesem", 0);
 		if (donesem == NULL) {
@@ -357,3 +369,149 @@ cvtest2(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Reader-writer lock test and benchmark.
+ *
+ * Readers spend a while in each read section checking that the data
+ * a writer last wrote is consistent, while writers change it one
+ * piece at a time and yield in the middle. First only readers run,
+ * in growing numbers: each does the same amount of work, so if reads
+ * really proceed in parallel the time taken stays about the same as
+ * readers are added (up to the number of cpus), rather than growing
+ * with them. Then readers and writers run together.
+ */
+
+static struct spinlock rwcount_lock = SPINLOCK_INITIALIZER;
+static unsigned rwreaders, rwmaxreaders;
+static volatile bool rwfailed;
+
+static
+void
+rwtestreader(void *junk, unsigned long num)
+{
+	int i;
+	volatile int j;
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		rwlock_acquire_read(testrwlock);
+
+		spinlock_acquire(&rwcount_lock);
+		rwreaders++;
+		if (rwreaders > rwmaxreaders) {
+			rwmaxreaders = rwreaders;
+		}
+		spinlock_release(&rwcount_lock);
+
+		for (j=0; j<NRWWORK; j++) {
+			if (testval2 != testval1*testval1) {
+				kprintf("thread %lu: Read during a write\n",
+					num);
+				rwfailed = true;
+				break;
+			}
+		}
+
+		spinlock_acquire(&rwcount_lock);
+		rwreaders--;
+		spinlock_release(&rwcount_lock);
+
+		rwlock_release_read(testrwlock);
+	}
+	V(donesem);
+}
+
+static
+void
+rwtestwriter(void *junk, unsigned long num)
+{
+	int i;
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		rwlock_acquire_write(testrwlock);
+
+		spinlock_acquire(&rwcount_lock);
+		if (rwreaders != 0) {
+			kprintf("thread %lu: Write during a read\n", num);
+			rwfailed = true;
+		}
+		spinlock_release(&rwcount_lock);
+
+		testval1 = num + i;
+		thread_yield();
+		testval2 = testval1*testval1;
+
+		rwlock_release_write(testrwlock);
+	}
+	V(donesem);
+}
+
+/*
+ * Run NREADERS readers and NWRITERS writers and report how long it
+ * took.
+ */
+static
+void
+rwtestrun(unsigned nreaders, unsigned nwriters)
+{
+	unsigned i;
+	int result;
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+
+	rwmaxreaders = 0;
+	gettime(&secs1, &nsecs1);
+
+	for (i=0; i<nreaders+nwriters; i++) {
+		result = thread_fork("rwtest",
+				     i < nreaders ? rwtestreader : rwtestwriter,
+				     NULL, i, NULL);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nreaders+nwriters; i++) {
+		P(donesem);
+	}
+
+	gettime(&secs2, &nsecs2);
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+
+	kprintf("%2u readers, %u writers: %lu.%09lu seconds, "
+		"at most %u reading at once\n",
+		nreaders, nwriters, (unsigned long) secs,
+		(unsigned long) nsecs, rwmaxreaders);
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	unsigned n;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting rwlock test...\n");
+
+	testval1 = 0;
+	testval2 = 0;
+	rwfailed = false;
+
+	for (n=1; n<=NRWREADERS; n*=2) {
+		rwtestrun(n, 0);
+	}
+	rwtestrun(NRWREADERS, NRWWRITERS);
+
+	if (rwfailed) {
+		kprintf("Test failed\n");
+	}
+	else {
+		kprintf("Rwlock test done.\n");
+	}
+
+	return 0;
+}
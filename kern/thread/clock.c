@@ -48,11 +48,12 @@
  */
 
 /*
- * Timing constants. These should be tuned along with any work done on
- * the scheduler.
+ * Timing parameters; see clock.h. These should be tuned along with
+ * any work done on the scheduler.
  */
-#define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
-#define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
+unsigned sched_quantum = 1;		/* Time slice of 1 hardclock. */
+unsigned schedule_hardclocks = 4;	/* Reschedule every 4 hardclocks. */
+unsigned migrate_hardclocks = 16;	/* Migrate every 16 hardclocks. */
 
 /*
  * Once a second, everything waiting on lbolt is awakened by CPU 0.
@@ -78,8 +79,11 @@ hardclock_bootstrap(void)
 void
 timerclock(void)
 {
-	/* Just broadcast on lbolt */
+	/* Broadcast on lbolt */
 	wchan_wakeall(lbolt);
+
+	/* This runs even when every cpu is idle and not ticking */
+	schedule_timerclock();
 }
 
 /*
@@ -94,13 +98,15 @@ hardclock(void)
 	 */
 	 
 	curcpu->c_hardclocks++;
-	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
+	if ((curcpu->c_hardclocks % schedule_hardclocks) == 0) {
 		schedule();
 	}
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
+	if ((curcpu->c_hardclocks % migrate_hardclocks) == 0) {
 		thread_consider_migration();
 	}
-	thread_yield();
+	if (thread_tick()) {
+		thread_yield();
+	}
 }
 
 /*
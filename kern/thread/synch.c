@@ -33,18 +33,55 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
+#include <cpu.h>
 #include <current.h>
 #include <synch.h>
 #include <spl.h>
+#include <kmem_cache.h>
 
 ////////////////////////////////////////////////////////////
 //
 // Semaphore.
 
+/*
+ * Semaphores are kept in an object cache with their spinlock and
+ * wait channel already set up; only the name and count are per use.
+ */
+static
+int
+sem_ctor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	sem->sem_wchan = wchan_create("sem");
+	if (sem->sem_wchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&sem->sem_lock);
+	sem->sem_name = NULL;
+	sem->sem_count = 0;
+	return 0;
+}
+
+static
+void
+sem_dtor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	spinlock_cleanup(&sem->sem_lock);
+	wchan_destroy(sem->sem_wchan);
+}
+
+static struct kmem_cache sem_cache =
+	KMEM_CACHE_INITIALIZER("sem", sizeof(struct semaphore),
+			       sem_ctor, sem_dtor);
+
 struct semaphore *
 sem_create(const char *name, int initial_count)
 {
@@ -52,25 +89,18 @@ sem_create(const char *name, int initial_count)
 
         KASSERT(initial_count >= 0);
 
-        sem = kmalloc(sizeof(struct semaphore));
+        sem = kmem_cache_alloc(&sem_cache);
         if (sem == NULL) {
                 return NULL;
         }
 
         sem->sem_name = kstrdup(name);
         if (sem->sem_name == NULL) {
-                kfree(sem);
+                kmem_cache_free(&sem_cache, sem);
                 return NULL;
         }
 
-	sem->sem_wchan = wchan_create(sem->sem_name);
-	if (sem->sem_wchan == NULL) {
-		kfree(sem->sem_name);
-		kfree(sem);
-		return NULL;
-	}
-
-	spinlock_init(&sem->sem_lock);
+	wchan_setname(sem->sem_wchan, sem->sem_name);
         sem->sem_count = initial_count;
 
         return sem;
@@ -81,11 +111,12 @@ sem_destroy(struct semaphore *sem)
 {
         KASSERT(sem != NULL);
 
-	/* wchan_cleanup will assert if anyone's waiting on it */
-	spinlock_cleanup(&sem->sem_lock);
-	wchan_destroy(sem->sem_wchan);
+	/* Back in the cache nobody may still be waiting on it */
+	KASSERT(wchan_isempty(sem->sem_wchan));
+	wchan_setname(sem->sem_wchan, "sem");
         kfree(sem->sem_name);
-        kfree(sem);
+	sem->sem_name = NULL;
+        kmem_cache_free(&sem_cache, sem);
 }
 
 /*
@@ -162,16 +193,46 @@ V(struct semaphore *sem)
 // Lock.
 
 /*
- * This simple lock is implemented using a binary
- * semaphore, or a counting semaphore initialized
- * to the value 1.
+ * Locks are cached too, with their wait channel and spinlock set up.
  */
+static
+int
+lock_ctor(void *obj)
+{
+	struct lock *lock = obj;
+
+	lock->lk_wchan = wchan_create("lock");
+	if (lock->lk_wchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&lock->lk_wlock);
+	spinlock_data_set(&lock->lk_word, 0);
+	lock->lk_name = NULL;
+	lock->lk_holder = NULL;
+	lock->lk_nsleepers = 0;
+	return 0;
+}
+
+static
+void
+lock_dtor(void *obj)
+{
+	struct lock *lock = obj;
+
+	spinlock_cleanup(&lock->lk_wlock);
+	wchan_destroy(lock->lk_wchan);
+}
+
+static struct kmem_cache lock_cache =
+	KMEM_CACHE_INITIALIZER("lock", sizeof(struct lock),
+			       lock_ctor, lock_dtor);
+
 struct lock *
 lock_create(const char *name)
 {
         struct lock *lock;
 
-        lock = kmalloc(sizeof(struct lock));
+        lock = kmem_cache_alloc(&lock_cache);
         if (lock == NULL) {
                 return NULL;
         }
@@ -179,15 +240,11 @@ lock_create(const char *name)
         lock->lk_name = kstrdup(name);
 		
         if (lock->lk_name == NULL) {
-                kfree(lock);
+                kmem_cache_free(&lock_cache, lock);
                 return NULL;
         }
 		
-		lock->lk_holder = NULL;
-        
-		lock->lk_sem = sem_create(name, 1);
-		
-		lock->lk_acquired = false;
+	wchan_setname(lock->lk_wchan, lock->lk_name);
 
         return lock;
 }
@@ -196,42 +253,92 @@ void
 lock_destroy(struct lock *lock)
 {
         KASSERT(lock != NULL);
+	KASSERT(lock->lk_holder == NULL);
+	KASSERT(lock->lk_nsleepers == 0);
+	KASSERT(wchan_isempty(lock->lk_wchan));
 		
-		lock->lk_holder = NULL;
-		
-        sem_destroy(lock->lk_sem);
+	wchan_setname(lock->lk_wchan, "lock");
 		
         kfree(lock->lk_name);
-        kfree(lock);
+        kmem_cache_free(&lock_cache, lock);
 }
 
 /*
- * Note that we do not need to disable interrupts
- * here, that is taken care of for us when we calling
- * the decrement function P().
- *
- * If the lock is not currently available at then
- * the calling thread will be put to sleep. Once
- * it wakes up, the lk_holder will be updated
- * accordingly.
+ * True if the lock's holder is running on some other cpu, and so
+ * likely to let go soon. The holder can change, or even exit, under
+ * us; the answer only decides whether to spin a little longer.
  */
-void
-lock_acquire(struct lock *lock)
+static
+bool
+lock_holder_running(struct lock *lock)
 {
-	P(lock->lk_sem); 	// decrement semaphore
+	struct thread *holder;
 
-	lock->lk_holder = curthread;
+	holder = lock->lk_holder;
+	if (holder == NULL) {
+		/* Between the test-and-set and setting lk_holder */
+		return true;
+	}
+	return holder->t_state == S_RUN && holder->t_cpu != curcpu->c_self;
 }
 
 /*
- * Note that we do not need to disable interrupts
- * here, that is taken care of for us when we calling
- * the decrement function P().
- *
- * The call to V() increments the semaphore, and if 
- * necessary wakes up another thread that was waiting
- * for the lock.
+ * Take the lock word. Test it first, so spinning waiters only read
+ * the word (and keep it in their caches) until it is released.
  */
+static
+bool
+lock_tryget(struct lock *lock)
+{
+	return spinlock_data_get(&lock->lk_word) == 0 &&
+		spinlock_data_testandset(&lock->lk_word) == 0;
+}
+
+void
+lock_acquire(struct lock *lock)
+{
+	/* May not block in an interrupt handler */
+	KASSERT(!CURCPU_EXISTS() || curthread->t_in_interrupt == false);
+
+	/* Fast path: nobody has it */
+	if (spinlock_data_testandset(&lock->lk_word) == 0) {
+		lock->lk_holder = curthread;
+		return;
+	}
+	KASSERT(!CURCPU_EXISTS() || lock->lk_holder != curthread);
+
+	while (1) {
+		/* Spin while the holder is busy on another cpu */
+		while (lock_holder_running(lock)) {
+			if (lock_tryget(lock)) {
+				lock->lk_holder = curthread;
+				return;
+			}
+		}
+
+		/*
+		 * Go to sleep. Count ourselves as a sleeper before
+		 * trying the lock one last time, so that whoever
+		 * releases it after that will know to wake us; and
+		 * bridge to the wchan lock as in P() so that the
+		 * wakeup can't get in before we're asleep.
+		 */
+		spinlock_acquire(&lock->lk_wlock);
+		lock->lk_nsleepers++;
+		if (lock_tryget(lock)) {
+			lock->lk_nsleepers--;
+			spinlock_release(&lock->lk_wlock);
+			lock->lk_holder = curthread;
+			return;
+		}
+		wchan_lock(lock->lk_wchan);
+		spinlock_release(&lock->lk_wlock);
+		wchan_sleep(lock->lk_wchan);
+
+		/* Whoever woke us took us off lk_nsleepers */
+	}
+}
+
 void
 lock_release(struct lock *lock)
 {
@@ -240,8 +347,22 @@ lock_release(struct lock *lock)
 	}
 	
 	lock->lk_holder = NULL;
-
-	V(lock->lk_sem);	// increment semaphore
+	spinlock_data_set(&lock->lk_word, 0);
+
+	/*
+	 * Wake one sleeper, if there are any. It competes for the
+	 * lock with everyone else when it runs, rather than being
+	 * handed it, so the lock is never held by a thread that
+	 * isn't running yet.
+	 */
+	if (lock->lk_nsleepers > 0) {
+		spinlock_acquire(&lock->lk_wlock);
+		if (lock->lk_nsleepers > 0) {
+			lock->lk_nsleepers--;
+			wchan_wakeone(lock->lk_wchan);
+		}
+		spinlock_release(&lock->lk_wlock);
+	}
 }
 
 bool
@@ -338,137 +459,228 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 //
 // Reader Writer Lock
 
+/* Bits in rwlock_state; the rest is the number of readers */
+#define RW_WRITER	0x80000000	/* A writer holds it */
+#define RW_WRITEWAIT	0x40000000	/* Writers are waiting */
+#define RW_READERS	0x3fffffff
+
 struct rwlock * 
 rwlock_create(const char *name)
 {
-		struct rwlock *rwlock;
-		
-		rwlock->rwlock_name = kstrdup(name);
+	struct rwlock *rwlock;
 
-		rwlock->rwlock_read = false;
-		rwlock->rwlock_write = false;
-		
-		rwlock->rwlock_reader_count = 0;
-		rwlock->rwlock_rqueue = 0;
-		rwlock->rwlock_wqueue = 0;
-		
-		rwlock->rwlock_lock = lock_create(rwlock->rwlock_name);
-		
-		rwlock->rwlock_read_cv = cv_create(rwlock->rwlock_name);
-		rwlock->rwlock_write_cv = cv_create(rwlock->rwlock_name);
-		
-		rwlock->rwlock_cv = cv_create(rwlock->rwlock_name);
+	rwlock = kmalloc(sizeof(struct rwlock));
+	if (rwlock == NULL) {
+		return NULL;
+	}
 
-		return rwlock;
+	rwlock->rwlock_name = kstrdup(name);
+	if (rwlock->rwlock_name == NULL) {
+		kfree(rwlock);
+		return NULL;
+	}
 
-	(void)name;
-	return rwlock;
+	rwlock->rwlock_readwchan = wchan_create(rwlock->rwlock_name);
+	if (rwlock->rwlock_readwchan == NULL) {
+		kfree(rwlock->rwlock_name);
+		kfree(rwlock);
+		return NULL;
+	}
+	rwlock->rwlock_writewchan = wchan_create(rwlock->rwlock_name);
+	if (rwlock->rwlock_writewchan == NULL) {
+		wchan_destroy(rwlock->rwlock_readwchan);
+		kfree(rwlock->rwlock_name);
+		kfree(rwlock);
+		return NULL;
+	}
 
+	spinlock_init(&rwlock->rwlock_wlock);
+	spinlock_data_set(&rwlock->rwlock_state, 0);
+	rwlock->rwlock_writer = NULL;
+	rwlock->rwlock_nreadwait = 0;
+	rwlock->rwlock_nwritewait = 0;
+
+	return rwlock;
 }
 
 void 
 rwlock_destroy(struct rwlock *rwlock)
 {
-		lock_destroy(rwlock->rwlock_lock);
-		
-		cv_destroy(rwlock->rwlock_read_cv);
-		cv_destroy(rwlock->rwlock_write_cv);
-		cv_destroy(rwlock->rwlock_cv);
-		
-		kfree(rwlock->rwlock_name);
+	KASSERT(rwlock != NULL);
+	KASSERT(spinlock_data_get(&rwlock->rwlock_state) == 0);
+
+	spinlock_cleanup(&rwlock->rwlock_wlock);
+	wchan_destroy(rwlock->rwlock_readwchan);
+	wchan_destroy(rwlock->rwlock_writewchan);
+	kfree(rwlock->rwlock_name);
+	kfree(rwlock);
 }
 
-void 
-rwlock_acquire_read(struct rwlock *rwlock)
+/*
+ * Add a reader if no writer holds or wants the lock. Returns false
+ * if one does.
+ */
+static
+bool
+rwlock_tryread(struct rwlock *rwlock)
 {
+	spinlock_data_t state;
 
-	/* Both a reader and writer cannot hold the lock at the same time */
-	KASSERT( (!rwlock->rwlock_write && rwlock->rwlock_read) ||
-			 (rwlock->rwlock_write && !rwlock->rwlock_read) ||
-			 (!rwlock->rwlock_write && !rwlock->rwlock_read) );
-			 
-
-	lock_acquire(rwlock->rwlock_lock);
-		if(rwlock->rwlock_write || rwlock->rwlock_wqueue > 0) {
-			rwlock->rwlock_rqueue += 1;
-			
-			/* This while loop will exit when the thread wakes up
-			 * after calling cv_wait. Once signalled rwlock_write
-			 * will be false and rwlock_read true.
-			 */
-			while(rwlock->rwlock_write  || rwlock->rwlock_wqueue > 0) {
-				/* Wait for signal when the writer is done */
-				cv_wait(rwlock->rwlock_read_cv, rwlock->rwlock_lock);
-			}
-			
-			rwlock->rwlock_rqueue -= 1;
+	while (1) {
+		state = spinlock_data_get(&rwlock->rwlock_state);
+		if (state & (RW_WRITER | RW_WRITEWAIT)) {
+			return false;
+		}
+		KASSERT((state & RW_READERS) != RW_READERS);
+		if (spinlock_data_cas(&rwlock->rwlock_state,
+				      state, state + 1) == state) {
+			return true;
 		}
-		rwlock->rwlock_read = true;
-		rwlock->rwlock_reader_count += 1;
-		rwlock->rwlock_write = false;
+	}
+}
 
-	(void)rwlock;
+/*
+ * Set or clear FLAG in the state word.
+ */
+static
+void
+rwlock_setflag(struct rwlock *rwlock, spinlock_data_t flag, bool on)
+{
+	spinlock_data_t state, newstate;
 
+	do {
+		state = spinlock_data_get(&rwlock->rwlock_state);
+		newstate = on ? (state | flag) : (state & ~flag);
+	} while (spinlock_data_cas(&rwlock->rwlock_state,
+				   state, newstate) != state);
 }
 
 void 
-rwlock_release_read(struct rwlock *rwlock)
+rwlock_acquire_read(struct rwlock *rwlock)
 {
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(rwlock->rwlock_writer != curthread);
 
-		rwlock->rwlock_reader_count -= 1;
-		
-		/* The idea here is that all readers need to finish before a writer is allowed to go. */
-		if(rwlock->rwlock_reader_count == 0 && rwlock->rwlock_wqueue > 0) {
-			cv_signal(rwlock->rwlock_write_cv, rwlock->rwlock_lock);
-			rwlock->rwlock_read = false;
-		}
-	
-	lock_release(rwlock->rwlock_lock);
+	/* Fast path: no writers about */
+	if (rwlock_tryread(rwlock)) {
+		return;
+	}
 
-	(void)rwlock;
+	/*
+	 * Sleep until a writer lets us in. As in P(), register as a
+	 * waiter before looking at the state for the last time, and
+	 * bridge to the wchan lock, so the writer's wakeup can't be
+	 * missed. A writer that wakes us takes us off the count.
+	 */
+	spinlock_acquire(&rwlock->rwlock_wlock);
+	while (1) {
+		rwlock->rwlock_nreadwait++;
+		if (rwlock_tryread(rwlock)) {
+			rwlock->rwlock_nreadwait--;
+			break;
+		}
+		wchan_lock(rwlock->rwlock_readwchan);
+		spinlock_release(&rwlock->rwlock_wlock);
+		wchan_sleep(rwlock->rwlock_readwchan);
+		spinlock_acquire(&rwlock->rwlock_wlock);
+	}
+	spinlock_release(&rwlock->rwlock_wlock);
+}
 
+void 
+rwlock_release_read(struct rwlock *rwlock)
+{
+	spinlock_data_t state;
+
+	do {
+		state = spinlock_data_get(&rwlock->rwlock_state);
+		KASSERT((state & RW_READERS) > 0);
+		KASSERT((state & RW_WRITER) == 0);
+	} while (spinlock_data_cas(&rwlock->rwlock_state,
+				   state, state - 1) != state);
+	state--;
+
+	/* The last reader out lets a waiting writer in */
+	if ((state & RW_READERS) == 0 && (state & RW_WRITEWAIT)) {
+		spinlock_acquire(&rwlock->rwlock_wlock);
+		wchan_wakeone(rwlock->rwlock_writewchan);
+		spinlock_release(&rwlock->rwlock_wlock);
+	}
 }
 
 void 
 rwlock_acquire_write(struct rwlock *rwlock)
 {
+	spinlock_data_t state;
 
-	/* Both a reader and writer cannot hold the lock at the same time */
-	KASSERT( (!rwlock->rwlock_write && rwlock->rwlock_read) ||
-			 (rwlock->rwlock_write && !rwlock->rwlock_read) ||
-			 (!rwlock->rwlock_write && !rwlock->rwlock_read) );
-	
-	lock_acquire(rwlock->rwlock_lock);
-		if(rwlock->rwlock_write || rwlock->rwlock_read) {
-			rwlock->rwlock_wqueue += 1;
-			while(rwlock->rwlock_read || rwlock->rwlock_write) {	// writer or reader already has lock
-				cv_wait(rwlock->rwlock_write_cv, rwlock->rwlock_lock);
-			}
-		}
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(rwlock->rwlock_writer != curthread);
 
-		rwlock->rwlock_wqueue -= 1;
-		rwlock->rwlock_write = true;
-		rwlock->rwlock_read = false;
+	/* Fast path: nobody at all about */
+	if (spinlock_data_cas(&rwlock->rwlock_state, 0, RW_WRITER) == 0) {
+		rwlock->rwlock_writer = curthread;
+		return;
+	}
 
-	(void)rwlock;
+	/*
+	 * Announce ourselves, which keeps new readers out, then wait
+	 * for the readers and any writer ahead of us to leave. Waiting
+	 * writers take turns under rwlock_wlock, so only readers and
+	 * the writer holding the lock can change the state meanwhile;
+	 * whichever of them leaves last wakes us.
+	 */
+	spinlock_acquire(&rwlock->rwlock_wlock);
+	if (rwlock->rwlock_nwritewait++ == 0) {
+		rwlock_setflag(rwlock, RW_WRITEWAIT, true);
+	}
+	while (1) {
+		state = spinlock_data_get(&rwlock->rwlock_state);
+		if ((state & (RW_WRITER | RW_READERS)) == 0 &&
+		    spinlock_data_cas(&rwlock->rwlock_state, state,
+				      state | RW_WRITER) == state) {
+			break;
+		}
+		if ((state & (RW_WRITER | RW_READERS)) == 0) {
+			/* Lost a race with a reader leaving; try again */
+			continue;
+		}
+		wchan_lock(rwlock->rwlock_writewchan);
+		spinlock_release(&rwlock->rwlock_wlock);
+		wchan_sleep(rwlock->rwlock_writewchan);
+		spinlock_acquire(&rwlock->rwlock_wlock);
+	}
+	if (--rwlock->rwlock_nwritewait == 0) {
+		rwlock_setflag(rwlock, RW_WRITEWAIT, false);
+	}
+	spinlock_release(&rwlock->rwlock_wlock);
 
+	rwlock->rwlock_writer = curthread;
 }
 
 void 
 rwlock_release_write(struct rwlock *rwlock)
 {
-
-		rwlock->rwlock_write = false;
-		
-		/* We favor readers over writers */
-		if(rwlock->rwlock_rqueue > 0) {
-			cv_broadcast(rwlock->rwlock_read_cv, rwlock->rwlock_lock);
-		}
-		else if(rwlock->rwlock_wqueue > 0) {
-			cv_signal(rwlock->rwlock_write_cv, rwlock->rwlock_lock);
-		}
-	lock_release(rwlock->rwlock_lock);
-
-	(void)rwlock;
-
+	spinlock_data_t state;
+
+	KASSERT(rwlock->rwlock_writer == curthread);
+	rwlock->rwlock_writer = NULL;
+
+	do {
+		state = spinlock_data_get(&rwlock->rwlock_state);
+		KASSERT(state & RW_WRITER);
+	} while (spinlock_data_cas(&rwlock->rwlock_state,
+				   state, state & ~RW_WRITER) != state);
+
+	/* Hand off to the next writer, or else to all the readers */
+	if (state & RW_WRITEWAIT) {
+		spinlock_acquire(&rwlock->rwlock_wlock);
+		wchan_wakeone(rwlock->rwlock_writewchan);
+		spinlock_release(&rwlock->rwlock_wlock);
+	}
+	else if (rwlock->rwlock_nreadwait > 0) {
+		spinlock_acquire(&rwlock->rwlock_wlock);
+		rwlock->rwlock_nreadwait = 0;
+		wchan_wakeall(rwlock->rwlock_readwchan);
+		spinlock_release(&rwlock->rwlock_wlock);
+	}
 }
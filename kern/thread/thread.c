@@ -45,11 +45,16 @@
 #include <current.h>
 #include <synch.h>
 #include <addrspace.h>
+#include <vm.h>
 #include <mainbus.h>
+#include <clock.h>
+#include <platform/maxcpus.h>
 #include <vfs.h>
 #include <kern/fcntl.h>
 #include <vnode.h>
 #include <process.h>
+#include <fd.h>
+#include <kmem_cache.h>
 
 #include "opt-synchprobs.h"
 #include "opt-defaultscheduler.h"
@@ -65,6 +70,42 @@ struct wchan {
 	struct spinlock wc_lock;	/* lock for mutual exclusion */
 };
 
+/*
+ * Multi-level feedback queue; see schedule().
+ */
+#define MLFQ_LEVELS		4
+
+/* Bumped once a second to boost everyone; threads catch up lazily */
+static volatile unsigned mlfq_epoch;
+
+/*
+ * A thread that ran on its cpu within this many of the cpu's
+ * hardclocks is taken to still have its working set in that cpu's
+ * cache. (Ticks while the cpu was idle don't count, as the clock is
+ * stopped then; idling doesn't disturb the cache anyway.)
+ */
+#define CACHE_WARM_HARDCLOCKS	2
+
+/* True if T may run on cpu C. */
+#define THREAD_ALLOWED(t, c) \
+	((((t)->t_cpumask) >> (c)->c_number) & 1)
+
+/*
+ * Object caches for threads, their stacks, and wait channels. Thread
+ * structures and stacks are reinitialized by whoever gets them; wait
+ * channels stay constructed while in the cache.
+ */
+static int wchan_ctor(void *obj);
+static void wchan_dtor(void *obj);
+
+static struct kmem_cache thread_cache =
+	KMEM_CACHE_INITIALIZER("thread", sizeof(struct thread), NULL, NULL);
+static struct kmem_cache thread_stack_cache =
+	KMEM_CACHE_INITIALIZER("thread stack", STACK_SIZE, NULL, NULL);
+static struct kmem_cache wchan_cache =
+	KMEM_CACHE_INITIALIZER("wchan", sizeof(struct wchan),
+			       wchan_ctor, wchan_dtor);
+
 /* Master array of CPUs. */
 DECLARRAY(cpu);
 DEFARRAY(cpu, /*no inline*/ );
@@ -127,14 +168,14 @@ thread_create(const char *name)
 	
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(&thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		kmem_cache_free(&thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -146,6 +187,11 @@ thread_create(const char *name)
 	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
+	thread->t_epoch = mlfq_epoch;
+	thread->t_cpumask = ~(uint32_t)0;
+	thread->t_lastran = 0;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
@@ -163,49 +209,48 @@ thread_create(const char *name)
 	pid_t pid = add_process_entry(thread);
 	thread->t_pid = pid;
 	
-	(void)i;
+	/* The structure may have come from the cache; forget old files */
+	for(i = 0; i < 3; i++) {
+		thread->t_fd_table[i] = NULL;
+	}
 	if(thread->t_pid > 1) {
 		(void)path;
 		vfs_open(path, O_RDONLY, 0644, &stdin);
 
 		// stdin 
-		thread->t_fd_table[0] = kmalloc(sizeof(struct fd));
+		thread->t_fd_table[0] = fd_create();
 		thread->t_fd_table[0]->flags = 0;
 		thread->t_fd_table[0]->offset = 0;
 		thread->t_fd_table[0]->ref_count = 0;
 		thread->t_fd_table[0]->vn = stdin;
-		thread->t_fd_table[0]->lock = lock_create("stdin");
 		thread->t_fd_table[0]->writable = true;
 		thread->t_fd_table[0]->readable = true;
 		
 		// stdout 
-		thread->t_fd_table[1] = kmalloc(sizeof(struct fd));
+		thread->t_fd_table[1] = fd_create();
 		thread->t_fd_table[1]->flags = 0;
 		thread->t_fd_table[1]->offset = 0;
 		thread->t_fd_table[1]->ref_count = 0;
 		thread->t_fd_table[1]->vn = stdin;
-		thread->t_fd_table[1]->lock = lock_create("stdout");
 		thread->t_fd_table[1]->writable = true;
 		thread->t_fd_table[1]->readable = false;
 
 		// stderr 
-		thread->t_fd_table[2] = kmalloc(sizeof(struct fd));
+		thread->t_fd_table[2] = fd_create();
 		thread->t_fd_table[2]->flags = 0;
 		thread->t_fd_table[2]->offset = 0;
 		thread->t_fd_table[2]->ref_count = 0;
 		thread->t_fd_table[2]->vn = stdin;
-		thread->t_fd_table[2]->lock = lock_create("stderr");
 		thread->t_fd_table[2]->writable = true;
 		thread->t_fd_table[2]->readable = true;
 
 		/*
 		for(i = 3; i < OPEN_MAX; i++) {
-			thread->t_fd_table[i] = kmalloc(sizeof(struct fd));
+			thread->t_fd_table[i] = fd_create();
 			thread->t_fd_table[i]->flags = 0;
 			thread->t_fd_table[i]->offset = 0;
 			thread->t_fd_table[i]->ref_count = 0;
 			thread->t_fd_table[i]->vn = NULL;
-			thread->t_fd_table[i]->lock = lock_create("fd lock");	
 			thread->t_fd_table[i]->writable = true;
 			thread->t_fd_table[i]->readable = true;		
 		}*/
@@ -247,42 +292,38 @@ init_fd_table(void) {
 	vfs_open(path, O_RDONLY, 0644, &stdin);
 
 	/* stdin */
-	curthread->t_fd_table[0] = kmalloc(sizeof(struct fd));
+	curthread->t_fd_table[0] = fd_create();
 	curthread->t_fd_table[0]->flags = 0;
 	curthread->t_fd_table[0]->offset = 0;
 	curthread->t_fd_table[0]->ref_count = 0;
 	curthread->t_fd_table[0]->vn = stdin;
-	curthread->t_fd_table[0]->lock = lock_create("stdin");
 	curthread->t_fd_table[0]->writable = true;
 	curthread->t_fd_table[0]->readable = true;
 	
 	/* stdout */
-	curthread->t_fd_table[1] = kmalloc(sizeof(struct fd));
+	curthread->t_fd_table[1] = fd_create();
 	curthread->t_fd_table[1]->flags = 0;
 	curthread->t_fd_table[1]->offset = 0;
 	curthread->t_fd_table[1]->ref_count = 0;
 	curthread->t_fd_table[1]->vn = stdin;
-	curthread->t_fd_table[1]->lock = lock_create("stdout");
 	curthread->t_fd_table[1]->writable = true;
 	curthread->t_fd_table[1]->readable = false;
 
 	/* stderr */
-	curthread->t_fd_table[2] = kmalloc(sizeof(struct fd));
+	curthread->t_fd_table[2] = fd_create();
 	curthread->t_fd_table[2]->flags = 0;
 	curthread->t_fd_table[2]->offset = 0;
 	curthread->t_fd_table[2]->ref_count = 0;
 	curthread->t_fd_table[2]->vn = stdin;
-	curthread->t_fd_table[2]->lock = lock_create("stderr");
 	curthread->t_fd_table[2]->writable = true;
 	curthread->t_fd_table[2]->readable = true;
 
 	for(i = 3; i < OPEN_MAX; i++) {
-		curthread->t_fd_table[i] = kmalloc(sizeof(struct fd));
+		curthread->t_fd_table[i] = fd_create();
 		curthread->t_fd_table[i]->flags = 0;
 		curthread->t_fd_table[i]->offset = 0;
 		curthread->t_fd_table[i]->ref_count = 0;
 		curthread->t_fd_table[i]->vn = NULL;
-		curthread->t_fd_table[i]->lock = lock_create("fd lock");	
 		curthread->t_fd_table[i]->writable = true;
 		curthread->t_fd_table[i]->readable = true;		
 	}
@@ -314,13 +355,20 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	c->c_npagecache = 0;
+	c->c_nzeropool = 0;
+	c->c_lastas = NULL;
+	c->c_migrant = NULL;
+	c->c_idlethread = NULL;
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
 	spinlock_init(&c->c_runqueue_lock);
+	c->c_nrunnable = 0;
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdowns_done = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -344,7 +392,7 @@ cpu_create(unsigned hardware_number)
 		/*c->c_curthread->t_stack = ... */
 	}
 	else {
-		c->c_curthread->t_stack = kmalloc(STACK_SIZE);
+		c->c_curthread->t_stack = kmem_cache_alloc(&thread_stack_cache);
 		if (c->c_curthread->t_stack == NULL) {
 			panic("cpu_create: couldn't allocate stack");
 		}
@@ -385,7 +433,7 @@ thread_destroy(struct thread *thread)
 
 	/* Thread subsystem fields */
 	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
+		kmem_cache_free(&thread_stack_cache, thread->t_stack);
 	}
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
@@ -394,7 +442,7 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(&thread_cache, thread);
 }
 
 /*
@@ -441,6 +489,7 @@ thread_panic(void)
 	curcpu->c_runqueue.tl_count = 0;
 	curcpu->c_runqueue.tl_head.tln_next = NULL;
 	curcpu->c_runqueue.tl_tail.tln_prev = NULL;
+	curcpu->c_nrunnable = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -580,6 +629,55 @@ cpu_hatch(unsigned software_number)
 	thread_exit();
 }
 
+/*
+ * Body of each cpu's idle thread: go idle, and come back to idle
+ * again whenever a migrant leaves us with nothing else to run. See
+ * thread_switch.
+ */
+static
+void
+thread_idle(void *unused1, unsigned long unused2)
+{
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		thread_yield();
+	}
+}
+
+/*
+ * Give cpu C its idle thread. It is set up like a forked thread but
+ * never made runnable; thread_switch runs it by hand.
+ */
+static
+void
+thread_create_idle(struct cpu *c)
+{
+	struct thread *t;
+	char namebuf[16];
+
+	snprintf(namebuf, sizeof(namebuf), "<idle #%d>", c->c_number);
+	t = thread_create(namebuf);
+	if (t == NULL) {
+		panic("thread_create_idle: Out of memory\n");
+	}
+	t->t_stack = kmem_cache_alloc(&thread_stack_cache);
+	if (t->t_stack == NULL) {
+		panic("thread_create_idle: couldn't allocate stack\n");
+	}
+	thread_checkstack_init(t);
+
+	t->t_cpu = c;
+	t->t_cpumask = (uint32_t)1 << c->c_number;
+
+	/* As in thread_fork; it starts out holding the runqueue lock */
+	t->t_iplhigh_count++;
+	switchframe_init(t, thread_idle, NULL, 0);
+
+	c->c_idlethread = t;
+}
+
 /*
  * Start up secondary cpus. Called from boot().
  */
@@ -590,6 +688,11 @@ thread_start_cpus(void)
 
 	kprintf("cpu0: %s\n", cpu_identify());
 
+	/* Every cpu is known by now; nothing can pin threads yet */
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		thread_create_idle(cpuarray_get(&allcpus, i));
+	}
+
 	cpu_startup_sem = sem_create("cpu_hatch", 0);
 	mainbus_start_cpus();
 	
@@ -600,10 +703,235 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Run queue operations. These keep c_nrunnable up to date, and must
+ * be called with the cpu's runqueue lock held.
+ */
+
+/*
+ * Put T on C's run queue. The default scheduler is plain round robin.
+ * The feedback queue keeps the run queue sorted by level, round robin
+ * within a level, so the head is always the best thread to run next;
+ * a thread that has missed a priority boost is boosted first.
+ */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	struct threadlist *rq = &c->c_runqueue;
+#if !OPT_DEFAULTSCHEDULER
+	struct threadlistnode *tln;
+#endif
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+	c->c_nrunnable = rq->tl_count + 1;
+
+#if OPT_DEFAULTSCHEDULER
+	threadlist_addtail(rq, t);
+#else
+	if (t->t_epoch != mlfq_epoch) {
+		t->t_epoch = mlfq_epoch;
+		t->t_priority = 0;
+		t->t_ticks = 0;
+	}
+
+	/* tl_head is the only node with no predecessor */
+	for (tln = rq->tl_tail.tln_prev; tln->tln_prev != NULL;
+	     tln = tln->tln_prev) {
+		if (tln->tln_self->t_priority <= t->t_priority) {
+			threadlist_insertafter(rq, tln->tln_self, t);
+			return;
+		}
+	}
+	threadlist_addhead(rq, t);
+#endif
+}
+
+/*
+ * Take the next thread to run off C's run queue, or NULL if empty.
+ */
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	struct thread *t;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+	t = threadlist_remhead(&c->c_runqueue);
+	c->c_nrunnable = c->c_runqueue.tl_count;
+	return t;
+}
+
+/*
+ * True if T, which last ran on its current cpu, probably still has
+ * data in that cpu's cache.
+ */
+static
+bool
+thread_cachewarm(struct thread *t)
+{
+	return t->t_cpu->c_hardclocks - t->t_lastran < CACHE_WARM_HARDCLOCKS;
+}
+
+/*
+ * Take a thread off C's run queue to move to cpu TO, or to any other
+ * cpu if TO is NULL: the last one, that is the one that would run
+ * last, that is allowed to go there, and unless WARM_OK, isn't cache
+ * warm. Returns NULL if there is none.
+ */
+static
+struct thread *
+runqueue_take(struct cpu *c, struct cpu *to, bool warm_ok)
+{
+	struct threadlistnode *tln;
+	struct thread *t;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	/* tl_head is the only node with no predecessor */
+	for (tln = c->c_runqueue.tl_tail.tln_prev; tln->tln_prev != NULL;
+	     tln = tln->tln_prev) {
+		t = tln->tln_self;
+
+		/*
+		 * Ordinarily, the cpu's curthread will not appear on
+		 * its run queue. However, it can under the following
+		 * circumstances:
+		 *   - it went to sleep;
+		 *   - the processor became idle, so it
+		 *     remained curthread;
+		 *   - it was reawakened, so it was put on the
+		 *     run queue;
+		 *   - and the processor hasn't fully unidled
+		 *     yet, so all these things are still true.
+		 *
+		 * *Migrating* curthread can cause bad things to
+		 * happen (Exercise: Why? And what?) so skip it.
+		 */
+		if (t == c->c_curthread) {
+			continue;
+		}
+		if (to != NULL ? !THREAD_ALLOWED(t, to) :
+		    (t->t_cpumask & ~((uint32_t)1 << c->c_number)) == 0) {
+			continue;
+		}
+		if (!warm_ok && thread_cachewarm(t)) {
+			continue;
+		}
+
+		threadlist_remove(&c->c_runqueue, t);
+		c->c_nrunnable = c->c_runqueue.tl_count;
+		return t;
+	}
+	return NULL;
+}
+
+/*
+ * Work stealing. Called by a cpu about to go idle, with no locks
+ * held: find the cpu with the most threads waiting to run, and move
+ * one of them that may run here to our own run queue. Returns true if a thread
+ * was moved. A cpu that is itself idle is left alone, as it is about
+ * to run whatever it has.
+ *
+ * This picks up new work (a burst of forks, say) as soon as a cpu
+ * runs out, instead of at the next thread_consider_migration.
+ */
+static
+bool
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct thread *t;
+	unsigned i, numcpus, most;
+
+	victim = NULL;
+	most = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self || c->c_isidle) {
+			continue;
+		}
+		if (c->c_nrunnable > most) {
+			most = c->c_nrunnable;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return false;
+	}
+
+	/* Anything is better than idling, but cold threads are cheaper */
+	spinlock_acquire(&victim->c_runqueue_lock);
+	t = runqueue_take(victim, curcpu->c_self, false);
+	if (t == NULL) {
+		t = runqueue_take(victim, curcpu->c_self, true);
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (t == NULL) {
+		return false;
+	}
+
+	/*
+	 * T is on no run queue now, and only we know it, so it's safe
+	 * to drop one lock before taking the other, which we must do
+	 * to avoid deadlock with a cpu stealing from us.
+	 */
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	t->t_cpu = curcpu->c_self;
+	runqueue_add(curcpu, t);
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+	      t->t_name, victim->c_number, curcpu->c_number);
+	return true;
+}
+
+/*
+ * Choose a cpu for T to run on, which is about to become runnable.
+ * Its own cpu is best if it is allowed there and its cache there is
+ * still warm, or that cpu is idle; otherwise the least loaded cpu it
+ * is allowed on, still preferring its own cpu on a tie.
+ */
+static
+struct cpu *
+thread_pickcpu(struct thread *t)
+{
+	struct cpu *c, *best;
+	unsigned i, numcpus, load, bestload;
+
+	if (THREAD_ALLOWED(t, t->t_cpu) &&
+	    (t->t_cpu->c_isidle || thread_cachewarm(t))) {
+		return t->t_cpu;
+	}
+
+	best = NULL;
+	bestload = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (!THREAD_ALLOWED(t, c)) {
+			continue;
+		}
+		/* The counts are only hints, so don't bother locking */
+		load = c->c_nrunnable + (c->c_isidle ? 0 : 1);
+		if (best == NULL || load < bestload ||
+		    (load == bestload && c == t->t_cpu)) {
+			best = c;
+			bestload = load;
+		}
+	}
+	KASSERT(best != NULL);
+	return best;
+}
+
 /*
  * Make a thread runnable.
  *
- * targetcpu might be curcpu; it might not be, too. 
+ * If ALREADY_HAVE_LOCK, the thread goes on its own cpu's run queue,
+ * whose lock we hold; otherwise it goes wherever thread_pickcpu says.
+ * Either might be curcpu; might not be, too.
  */
 static
 void
@@ -612,7 +940,6 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	struct cpu *targetcpu;
 	bool isidle;
 
-	/* Lock the run queue of the target thread's cpu. */
 	targetcpu = target->t_cpu;
 
 	if (already_have_lock) {
@@ -620,11 +947,29 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		KASSERT(spinlock_do_i_hold(&targetcpu->c_runqueue_lock));
 	}
 	else {
+		targetcpu = thread_pickcpu(target);
+		if (targetcpu != target->t_cpu) {
+			/*
+			 * It can't move while its old cpu might still be
+			 * on its stack: either switching away from it,
+			 * which happens with that cpu's runqueue lock
+			 * held, or idling on it as curthread (see
+			 * runqueue_take).
+			 */
+			spinlock_acquire(&target->t_cpu->c_runqueue_lock);
+			if (target->t_cpu->c_curthread == target) {
+				targetcpu = target->t_cpu;
+			}
+			spinlock_release(&target->t_cpu->c_runqueue_lock);
+			target->t_cpu = targetcpu;
+		}
+
+		/* Lock the run queue of the target thread's cpu. */
 		spinlock_acquire(&targetcpu->c_runqueue_lock);
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -638,6 +983,24 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 }
 
+/*
+ * Called after a context switch, with the runqueue lock released:
+ * if the thread we switched away from may no longer run on this cpu,
+ * put it on one where it may.
+ */
+static
+void
+thread_send_migrant(void)
+{
+	struct thread *t;
+
+	t = curcpu->c_migrant;
+	if (t != NULL) {
+		curcpu->c_migrant = NULL;
+		thread_make_runnable(t, false);
+	}
+}
+
 /*
  * Create a new thread based on an existing one.
  *
@@ -663,7 +1026,7 @@ thread_fork(const char *name,
 	}
 
 	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
+	newthread->t_stack = kmem_cache_alloc(&thread_stack_cache);
 	if (newthread->t_stack == NULL) {
 		thread_destroy(newthread);
 		return ENOMEM;
@@ -676,6 +1039,7 @@ thread_fork(const char *name,
 
 	/* Thread subsystem fields */
 	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_cpumask = curthread->t_cpumask;
 
 	/* Copy parents address space */
 	struct addrspace **retaddr;
@@ -742,7 +1106,7 @@ thread_fork_pid(const char *name,
 	}
 
 	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
+	newthread->t_stack = kmem_cache_alloc(&thread_stack_cache);
 	if (newthread->t_stack == NULL) {
 		thread_destroy(newthread);
 		return ENOMEM;
@@ -755,6 +1119,7 @@ thread_fork_pid(const char *name,
 
 	/* Thread subsystem fields */
 	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_cpumask = curthread->t_cpumask;
 
 	/* VM fields */
 	/* do not clone address space -- let caller decide on that */
@@ -812,6 +1177,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 {
 	struct thread *cur, *next;
 	int spl;
+	bool tickless;
 
 	DEBUGASSERT(curcpu->c_curthread == curthread);
 	DEBUGASSERT(curthread->t_cpu == curcpu->c_self);
@@ -836,8 +1202,14 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
-	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	/*
+	 * Micro-optimization: if nothing to do, just return. But a
+	 * thread that may not stay here leaves anyway, and the idle
+	 * thread yields precisely to go idle.
+	 */
+	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue) &&
+	    (THREAD_ALLOWED(cur, curcpu) || curcpu->c_idlethread == NULL) &&
+	    cur != curcpu->c_idlethread) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -849,7 +1221,15 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		panic("Illegal S_RUN in thread_switch\n");
 		break;
 	    case S_READY:
-		thread_make_runnable(cur, true /*have lock*/);
+		if (cur == curcpu->c_idlethread) {
+			/* Never queued; see below */
+		}
+		else if (THREAD_ALLOWED(cur, curcpu)) {
+			thread_make_runnable(cur, true /*have lock*/);
+		}
+		else {
+			curcpu->c_migrant = cur;
+		}
 		break;
 	    case S_SLEEP:
 		cur->t_wchan_name = wc->wc_name;
@@ -875,6 +1255,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		break;
 	}
 	cur->t_state = newstate;
+	cur->t_lastran = curcpu->c_hardclocks;
 
 	/*
 	 * Get the next thread. While there isn't one, call md_idle().
@@ -891,19 +1272,47 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	 * Note that c_isidle becomes true briefly even if we don't go
 	 * idle. However, because one is supposed to hold the runqueue
 	 * lock to look at it, this should not be visible or matter.
+	 *
+	 * Before actually idling, try to take work off a busier cpu;
+	 * failing that, use the time to zero free pages for later
+	 * allocations, one page per pass so a thread made runnable
+	 * meanwhile is noticed promptly.
+	 *
+	 * We must not idle on the stack of a thread that is leaving
+	 * for another cpu, since it can't go until we are off it;
+	 * switch to the idle thread instead, which sends it on and
+	 * idles on its own stack.
 	 */
 
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
+	tickless = false;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
-		if (next == NULL) {
+		next = runqueue_remhead(curcpu);
+		if (next == NULL && curcpu->c_migrant == cur) {
+			next = curcpu->c_idlethread;
+		}
+		else if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (!thread_steal() && !vm_prezero_page()) {
+				/*
+				 * Nothing at all to do. Stop the
+				 * clock, so we sleep until somebody
+				 * has work for us.
+				 */
+				if (!tickless) {
+					mainbus_hardclock_enable(false);
+					tickless = true;
+				}
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+	if (tickless) {
+		mainbus_hardclock_enable(true);
+	}
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -977,6 +1386,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		as_activate(cur->t_addrspace);
 	}
 
+	/* Send on a thread that can't stay here. */
+	thread_send_migrant();
+
 	/* Clean up dead threads. */
 	exorcise();
 
@@ -1012,6 +1424,9 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 		as_activate(cur->t_addrspace);
 	}
 
+	/* Send on a thread that can't stay here. */
+	thread_send_migrant();
+
 	/* Clean up dead threads. */
 	exorcise();
 
@@ -1063,7 +1478,8 @@ thread_exit(void)
 	
 	/* Free file descriptor table */
 	for(i = 0; i < 3; i++) {
-		kfree(cur->t_fd_table[i]);
+		fd_destroy(cur->t_fd_table[i]);
+		cur->t_fd_table[i] = NULL;
 		//if(cur->t_fd_table[i] != NULL && cur->t_pid > 1) {
 		//	lock_destroy(cur->t_fd_table[i]->lock);
 		//	kfree(cur->t_fd_table[i]);
@@ -1102,6 +1518,30 @@ thread_yield(void)
 	thread_switch(S_READY, NULL);
 }
 
+/*
+ * Pin the current thread to the cpus in MASK. If we're on one that
+ * isn't in it, we move to one that is at once.
+ */
+int
+thread_setaffinity(uint32_t mask)
+{
+	unsigned numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	if (numcpus < 32) {
+		mask &= ((uint32_t)1 << numcpus) - 1;
+	}
+	if (mask == 0) {
+		return EINVAL;
+	}
+
+	curthread->t_cpumask = mask;
+	if (!THREAD_ALLOWED(curthread, curcpu)) {
+		thread_yield();
+	}
+	return 0;
+}
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -1109,20 +1549,141 @@ thread_yield(void)
  *
  * This is called periodically from hardclock(). It should reshuffle
  * the current CPU's run queue by job priority.
+ *
+ * Unless the default scheduler is configured, this is a multi-level
+ * feedback queue. Threads start at level 0, and drop a level each
+ * time they use up the quantum of their level, which doubles at each
+ * level down; so CPU-bound jobs sink and get long time slices and
+ * few switches, while threads that mostly sleep (the shell, console
+ * readers) stay near the top and run as soon as they wake. A running
+ * thread is also preempted at the next tick when a higher level
+ * thread is waiting. Once a second everything goes back to level 0,
+ * so nothing starves and a job that turns interactive gets its
+ * priority back.
+ *
+ * Either way, a thread that has its cpu to itself is never preempted.
  */
 
 #if OPT_DEFAULTSCHEDULER
+bool
+thread_tick(void)
+{
+	struct thread *cur;
+
+	cur = curthread;
+	if (curcpu->c_isidle) {
+		return false;
+	}
+
+	/* Get off a cpu we're not allowed on */
+	if (!THREAD_ALLOWED(cur, curcpu)) {
+		return true;
+	}
+
+	/* Round robin, sched_quantum ticks at a time */
+	cur->t_ticks++;
+	if (cur->t_ticks < sched_quantum) {
+		return false;
+	}
+	cur->t_ticks = 0;
+	return curcpu->c_nrunnable > 0;
+}
+
 void
 schedule(void)
 {
   // 28 Feb 2012 : GWA : Leave the default scheduler alone!
 }
+
+void
+schedule_timerclock(void)
+{
+}
 #else
+bool
+thread_tick(void)
+{
+	struct thread *cur, *next;
+	bool yield;
+
+	cur = curthread;
+
+	/* The idle loop runs in whichever thread last slept */
+	if (curcpu->c_isidle) {
+		return false;
+	}
+
+	/* Get off a cpu we're not allowed on */
+	if (!THREAD_ALLOWED(cur, curcpu)) {
+		return true;
+	}
+
+	if (cur->t_epoch != mlfq_epoch) {
+		cur->t_epoch = mlfq_epoch;
+		cur->t_priority = 0;
+		cur->t_ticks = 0;
+	}
+
+	cur->t_ticks++;
+	if (cur->t_ticks >= sched_quantum << cur->t_priority) {
+		if (cur->t_priority < MLFQ_LEVELS - 1) {
+			cur->t_priority++;
+		}
+		cur->t_ticks = 0;
+		return curcpu->c_nrunnable > 0;
+	}
+
+	if (curcpu->c_nrunnable == 0) {
+		return false;
+	}
+
+	/* Let a higher level thread in now */
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	yield = false;
+	if (!threadlist_isempty(&curcpu->c_runqueue)) {
+		next = curcpu->c_runqueue.tl_head.tln_next->tln_self;
+		yield = next->t_priority < cur->t_priority;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	return yield;
+}
+
 void
 schedule(void)
 {
-  // 28 Feb 2012 : GWA : Implement your scheduler that prioritizes
-  // "interactive" threads here.
+	struct threadlist boosted;
+	struct thread *t;
+
+	/*
+	 * Bring threads queued since before the last boost up to
+	 * date. They all go to level 0, so requeueing them in order
+	 * keeps the queue sorted.
+	 */
+	threadlist_init(&boosted);
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	while (!threadlist_isempty(&curcpu->c_runqueue)) {
+		t = curcpu->c_runqueue.tl_tail.tln_prev->tln_self;
+		if (t->t_epoch == mlfq_epoch) {
+			break;
+		}
+		threadlist_remtail(&curcpu->c_runqueue);
+		threadlist_addhead(&boosted, t);
+	}
+	while ((t = threadlist_remtail(&boosted)) != NULL) {
+		t->t_epoch = mlfq_epoch;
+		t->t_priority = 0;
+		t->t_ticks = 0;
+		threadlist_addhead(&curcpu->c_runqueue, t);
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+	threadlist_cleanup(&boosted);
+}
+
+void
+schedule_timerclock(void)
+{
+	mlfq_epoch++;
 }
 #endif
 
@@ -1131,7 +1692,9 @@ schedule(void)
  *
  * This is also called periodically from hardclock(). If the current
  * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
+ * threads across to those other other CPUs. (CPUs that run out of
+ * work entirely don't wait for this; see thread_steal.) Threads that
+ * ran very recently stay put, as do threads pinned to this CPU.
  *
  * Migrating threads isn't free because of cache affinity; a thread's
  * working cache set will end up having to be moved to the other CPU,
@@ -1150,18 +1713,16 @@ thread_consider_migration(void)
 	unsigned i, numcpus;
 	struct cpu *c;
 	struct threadlist victims;
+	struct threadlistnode *tln;
 	struct thread *t;
 
-	my_count = total_count = 0;
+	/* The counts are only hints, so don't bother locking */
+	my_count = curcpu->c_nrunnable;
+	total_count = 0;
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
-		}
-		spinlock_release(&c->c_runqueue_lock);
+		total_count += c->c_nrunnable;
 	}
 
 	one_share = DIVROUNDUP(total_count, numcpus);
@@ -1173,9 +1734,14 @@ thread_consider_migration(void)
 	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
+		/* Leave cache-warm and pinned threads where they are */
+		t = runqueue_take(curcpu->c_self, NULL, false);
+		if (t == NULL) {
+			break;
+		}
 		threadlist_addhead(&victims, t);
 	}
+	to_send = i;
 	spinlock_release(&curcpu->c_runqueue_lock);
 
 	for (i=0; i < numcpus && to_send > 0; i++) {
@@ -1184,38 +1750,18 @@ thread_consider_migration(void)
 			continue;
 		}
 		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
+		tln = victims.tl_head.tln_next;
+		while (c->c_nrunnable < one_share && to_send > 0 &&
+		       tln->tln_next != NULL) {
+			t = tln->tln_self;
+			tln = tln->tln_next;
+			if (!THREAD_ALLOWED(t, c)) {
 				continue;
 			}
 
+			threadlist_remove(&victims, t);
 			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
+			runqueue_add(c, t);
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
@@ -1239,7 +1785,7 @@ thread_consider_migration(void)
 	if (!threadlist_isempty(&victims)) {
 		spinlock_acquire(&curcpu->c_runqueue_lock);
 		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+			runqueue_add(curcpu, t);
 		}
 		spinlock_release(&curcpu->c_runqueue_lock);
 	}
@@ -1262,31 +1808,61 @@ thread_consider_migration(void)
  * arrangements should be made to free it after the wait channel is
  * destroyed.
  */
+static
+int
+wchan_ctor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_init(&wc->wc_lock);
+	threadlist_init(&wc->wc_threads);
+	wc->wc_name = NULL;
+	return 0;
+}
+
+static
+void
+wchan_dtor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_cleanup(&wc->wc_lock);
+	threadlist_cleanup(&wc->wc_threads);
+}
+
 struct wchan *
 wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = kmem_cache_alloc(&wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
-	spinlock_init(&wc->wc_lock);
-	threadlist_init(&wc->wc_threads);
 	wc->wc_name = name;
 	return wc;
 }
 
 /*
  * Destroy a wait channel. Must be empty and unlocked.
- * (The corresponding cleanup functions require this.)
+ * (It goes back in the cache as it is, ready for reuse.)
  */
 void
 wchan_destroy(struct wchan *wc)
 {
-	spinlock_cleanup(&wc->wc_lock);
-	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	KASSERT(threadlist_isempty(&wc->wc_threads));
+	KASSERT(!spinlock_do_i_hold(&wc->wc_lock));
+	wc->wc_name = NULL;
+	kmem_cache_free(&wchan_cache, wc);
+}
+
+/*
+ * Change the symbolic name of a wait channel.
+ */
+void
+wchan_setname(struct wchan *wc, const char *name)
+{
+	wc->wc_name = name;
 }
 
 /*
@@ -1430,21 +2006,34 @@ ipi_broadcast(int code)
 	}
 }
 
+/*
+ * Queue MAPPING on TARGET. Call with TARGET's IPI lock held.
+ */
+static
 void
-ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+ipi_tlbshootdown_queue(struct cpu *target, const struct tlbshootdown *mapping)
 {
 	int n;
 
-	spinlock_acquire(&target->c_ipi_lock);
-
 	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
+	if (n == TLBSHOOTDOWN_ALL) {
+		/* Already flushing everything */
+	}
+	else if (n == TLBSHOOTDOWN_MAX) {
 		target->c_numshootdown = TLBSHOOTDOWN_ALL;
 	}
 	else {
 		target->c_shootdown[n] = *mapping;
 		target->c_numshootdown = n+1;
 	}
+}
+
+void
+ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+{
+	spinlock_acquire(&target->c_ipi_lock);
+
+	ipi_tlbshootdown_queue(target, mapping);
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
@@ -1452,6 +2041,86 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+void
+cpu_forget_addrspace(struct addrspace *as)
+{
+	unsigned i, numcpus;
+	struct cpu *c;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i < numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self && c->c_lastas == as) {
+			c->c_lastas = NULL;
+		}
+	}
+}
+
+unsigned
+cpu_pooled_pages(void)
+{
+	unsigned i, numcpus, n;
+	struct cpu *c;
+
+	n = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i < numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		n += c->c_npagecache + c->c_nzeropool;
+	}
+	return n;
+}
+
+void
+ipi_tlbshootdown_mask(uint32_t cpumask,
+		      const struct tlbshootdown *mappings, unsigned n)
+{
+	unsigned i, j, numcpus;
+	unsigned seen[MAXCPUS];
+	struct cpu *c;
+
+	numcpus = cpuarray_num(&allcpus);
+	KASSERT(numcpus <= MAXCPUS);
+
+	cpumask &= ~((uint32_t)1 << curcpu->c_number);
+	if (cpumask == 0 || (n == 0 && mappings != NULL)) {
+		return;
+	}
+
+	for (i=0; i < numcpus; i++) {
+		if ((cpumask & ((uint32_t)1 << i)) == 0) {
+			continue;
+		}
+		c = cpuarray_get(&allcpus, i);
+
+		spinlock_acquire(&c->c_ipi_lock);
+		seen[i] = c->c_shootdowns_done;
+		if (mappings == NULL) {
+			c->c_numshootdown = TLBSHOOTDOWN_ALL;
+		}
+		for (j=0; j < n; j++) {
+			ipi_tlbshootdown_queue(c, &mappings[j]);
+		}
+		c->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
+		mainbus_send_ipi(c);
+		spinlock_release(&c->c_ipi_lock);
+	}
+
+	/*
+	 * Wait for every target to get through a batch that started
+	 * after ours was queued.
+	 */
+	for (i=0; i < numcpus; i++) {
+		if ((cpumask & ((uint32_t)1 << i)) == 0) {
+			continue;
+		}
+		c = cpuarray_get(&allcpus, i);
+		while (c->c_shootdowns_done == seen[i]) {
+			/* spin */
+		}
+	}
+}
+
 void
 interprocessor_interrupt(void)
 {
@@ -1492,6 +2161,7 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdowns_done++;
 	}
 
 	curcpu->c_ipi_pending = 0;
@@ -30,8 +30,19 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <uio.h>
+#include <stat.h>
+#include <vfs.h>
+#include <vnode.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <kmem_cache.h>
+
+static void pte_release(struct addrspace *as, struct page_table_entry *entry);
+static int as_writeback_region(struct addrspace *as, struct region *region, bool clean);
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -50,20 +61,28 @@ as_create(void)
 	}
 
 	/* Allocate some stuff */
-	as->pages = kmalloc(sizeof(struct page_table));
+	as->pages = pt_create();
 	if(as->pages == NULL) {
+		kfree(as);
 		return NULL;
 	}
-	as->pages->firstentry = kmalloc(sizeof(struct page_table_entry));
 	
 	as->regions = kmalloc(sizeof(struct region_list));
 	if(as->regions == NULL) {
+		pt_destroy(as->pages);
+		kfree(as);
 		return NULL;
 	}
 	as->regions->firstregion = kmalloc(sizeof(struct region));
+	if(as->regions->firstregion == NULL) {
+		kfree(as->regions);
+		pt_destroy(as->pages);
+		kfree(as);
+		return NULL;
+	}
 	
 	/* Initialize some stuff */
-	as->heap_page = NULL;
+	as->heap_region = NULL;
 	as->heap_start = -1;
 	as->heap_end = -1;
 	as->n_heap_pages = 0;
@@ -72,14 +91,57 @@ as_create(void)
 	as->regions->firstregion->vaddr = -1;
 	as->regions->firstregion->npages = -1;
 	as->regions->firstregion->permissions = -1;
-
-	as->pages->firstentry->next = NULL;
-	as->pages->firstentry->prev = NULL;
-	as->pages->firstentry->page = NULL;
+	as->regions->firstregion->flags = 0;
+	as->regions->firstregion->vn = NULL;
 	
 	return as;
 }
 
+/*
+ * Does REGION need its pages shared in place by a forked child,
+ * rather than copy-on-write?
+ */
+static bool
+as_region_shared(struct region *region)
+{
+	return (int)region->vaddr != -1 && (region->flags & REGION_SHARED) &&
+	       (region->permissions & PAGE_WRITABLE);
+}
+
+/*
+ * Make every page of every writable MAP_SHARED region of AS resident
+ * and private to it, so that as_copy can hand the child the very same
+ * pages. One left for each side to fault in on its own would give
+ * them different copies.
+ */
+static int
+as_load_shared(struct addrspace *as)
+{
+	struct region *region;
+	struct page_table_entry *pte;
+	vaddr_t vaddr;
+	size_t i;
+	int result;
+	
+	for(region = as->regions->firstregion; region != NULL; region = region->next) {
+		if(!as_region_shared(region)) {
+			continue;
+		}
+		for(i = 0; i < region->npages; i++) {
+			vaddr = region->vaddr + i * PAGE_SIZE;
+			pte = pt_lookup(as->pages, vaddr);
+			if(pte != NULL && pte->page != NULL && pte->page != vm_zeropage) {
+				continue;
+			}
+			result = as_load_page(as, vaddr, true, &pte);
+			if(result) {
+				return result;
+			}
+		}
+	}
+	return 0;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
@@ -91,63 +153,141 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	}
 	
 	if(old == NULL) {
+		/* Kernel threads have no address space to copy */
+		as_destroy(newas);
+		*ret = NULL;
 		return 0;
 	}
 	
+	/*
+	 * Copy the region list, so pages the parent never touched can
+	 * still be faulted in by the child.
+	 */
+	struct region *region, *copy;
+	
+	for(region = old->regions->firstregion; region != NULL; region = region->next) {
+		if((int)region->vaddr == -1) {
+			continue;
+		}
+		if(add_region(newas, region->vaddr, region->npages, region->permissions)) {
+			as_destroy(newas);
+			return ENOMEM;
+		}
+		/* The new list has no holes, so add_region appended it */
+		for(copy = newas->regions->firstregion; copy->next != NULL; copy = copy->next);
+		copy->flags = region->flags;
+		if(region == old->heap_region) {
+			newas->heap_region = copy;
+		}
+		if(region->vn != NULL) {
+			as_define_backing(newas, region->file_vaddr, region->vn,
+			                  region->file_offset, region->file_size);
+		}
+	}
+	newas->heap_start = old->heap_start;
+	newas->heap_end = old->heap_end;
+	newas->n_heap_pages = old->n_heap_pages;
+	
 	/*
 	 * Copy page table from old address space into new one.
-	 * Note that the page table is just a doubly linked list 
-	 * whose data element is a pointer to a page in the coremap.
+	 * Walk every populated second-level table and share each
+	 * resident page with the new address space copy-on-write.
+	 * A shared page is never mapped writable (see vm_tlb_load),
+	 * and the first write from either side makes a private copy.
+	 * Pages out on swap are brought back in first, since a swap
+	 * slot belongs to exactly one page table entry.
+	 *
+	 * Writable MAP_SHARED pages are the exception: both sides
+	 * must keep seeing each other's writes, so they are shared
+	 * for good and written in place. All of them are made
+	 * resident first; while shared they can't be evicted.
 	 */
-	struct page_table_entry *oldentry = old->pages->firstentry;
-	struct page_table_entry *newentry = newas->pages->firstentry;
-
-	int src, dst;
+	struct page_table_entry **l2;
+	struct page_table_entry *oldentry;
+	struct coremap_entry *page;
+	unsigned l1i;
+	int l2i, spl, result;
+	vaddr_t vaddr;
+	size_t i;
 	
-	if(oldentry == NULL) {
-		return 0;		// Page table is empty, nothing to copy.
+	result = as_load_shared(old);
+	if(result) {
+		as_destroy(newas);
+		return result;
 	}
-		
-	while(oldentry != NULL) {
-		if(oldentry->page == NULL) {
-			oldentry = oldentry->next;
+	
+	for(l1i = 0; l1i < PT_L1_ENTRIES; l1i++) {
+		l2 = old->pages->pt_dir[l1i];
+		if(l2 == NULL) {
 			continue;
 		}
 		
-		src = get_coremap_index(oldentry->page->vbase);
-		
-		/* Allocate a new page */
-		dst = alloc_page();
-		
-		/* Add new page table entry */
-		newentry->page = &coremap[dst];
-		newentry->next = kmalloc(sizeof(struct page_table_entry));
-		newentry->next->prev = newentry;
-		newentry->next->next = NULL;
-		
-		/* Copy the page */
-		memcpy((void *)coremap[dst].vbase, (void *)coremap[src].vbase, PAGE_SIZE);
-		
-		/* Update coremap entry */
-		if(!spinlock_do_i_hold(&coremap_lock)) {
-			spinlock_acquire(&coremap_lock);
-		}
-		spinlock_acquire(&coremap[dst].lock);
+		for(l2i = 0; l2i < PT_L2_ENTRIES; l2i++) {
+			oldentry = l2[l2i];
+			if(oldentry == NULL) {
+				continue;
+			}
+			vaddr = PT_VADDR(l1i, l2i);
 			
-			coremap[dst].permissions = coremap[src].permissions; 
-			coremap[dst].as = newas; 
-			coremap[dst].as_vbase = coremap[src].as_vbase;
+		 again:
+			page = oldentry->page;
+			if(page == NULL) {
+				if(!oldentry->is_on_disk) {
+					continue;
+				}
+				if(as_load_page(old, vaddr, false, &oldentry)) {
+					as_destroy(newas);
+					return ENOMEM;
+				}
+				goto again;
+			}
 			
-		spinlock_release(&coremap[dst].lock);
-		if(spinlock_do_i_hold(&coremap_lock)) {
-			spinlock_release(&coremap_lock);
-		} 
-		
-		/* Go to next element each linked list */
-		newentry = newentry->next;
-		oldentry = oldentry->next;
+			spinlock_acquire(&page->lock);
+			if(page->is_locked || oldentry->page != page) {
+				/* Being evicted; wait for it and look again */
+				spinlock_release(&page->lock);
+				vm_wait_busy(page);
+				goto again;
+			}
+			page->refcount++;
+			/* Neither side's swap slot holds its contents yet */
+			page->state = PAGE_DIRTY;
+			spinlock_release(&page->lock);
+			
+			/* Add new page table entry */
+			if(add_pte(newas, vaddr, page) == NULL) {
+				free_page(page->vbase);
+				as_destroy(newas);
+				return ENOMEM;
+			}
+		}
 	}
 	
+	/* Nobody has faulted since the walk, so these are all resident */
+	for(region = old->regions->firstregion; region != NULL; region = region->next) {
+		if(!as_region_shared(region)) {
+			continue;
+		}
+		for(i = 0; i < region->npages; i++) {
+			oldentry = pt_lookup(old->pages, region->vaddr + i * PAGE_SIZE);
+			KASSERT(oldentry != NULL && oldentry->page != NULL);
+			page = oldentry->page;
+			spinlock_acquire(&page->lock);
+			page->is_shared = true;
+			spinlock_release(&page->lock);
+		}
+	}
+	
+	/*
+	 * Our own TLB may still hold writable entries for pages that
+	 * are now shared. Drop them so the next write faults and copies,
+	 * and make any cpu the parent ran on before do the same.
+	 */
+	spl = splhigh();
+	vm_tlbshootdown_all();
+	splx(spl);
+	cpu_forget_addrspace(old);
+	
 	*ret = newas;
 	return 0;
 }
@@ -155,46 +295,94 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 void
 as_destroy(struct addrspace *as)
 {
-	struct page_table_entry *entry = as->pages->firstentry;
-	struct page_table_entry *tmp;
+	struct page_table_entry **l2;
+	struct page_table_entry *entry;
+	unsigned l1i;
+	int l2i, spl;
 	
 	struct region *region = as->regions->firstregion;
 	struct region *tmpregion;
 	
-	/* Free up page table */
-	while(entry != NULL) {
-		if(entry->disk_locale > 0)
-		{
-			swap_free(entry->disk_locale);
+	/* Shared file mappings go back to their files first */
+	for(tmpregion = region; tmpregion != NULL; tmpregion = tmpregion->next) {
+		if((int)tmpregion->vaddr != -1) {
+			as_writeback_region(as, tmpregion, false);
 		}
-		entry->is_on_disk = false;
-		tmp = entry;
-		entry = entry->next;
-		kfree(tmp);
 	}
-	//kfree(as->pages);
+	
+	/* Release every page and swap slot the page table refers to */
+	for(l1i = 0; l1i < PT_L1_ENTRIES; l1i++) {
+		l2 = as->pages->pt_dir[l1i];
+		if(l2 == NULL) {
+			continue;
+		}
+		
+		for(l2i = 0; l2i < PT_L2_ENTRIES; l2i++) {
+			entry = l2[l2i];
+			if(entry != NULL) {
+				pte_release(as, entry);
+			}
+		}
+	}
+	
+	/* Free up page table */
+	pt_destroy(as->pages);
+	
+	/* A new address space may be allocated at this address */
+	cpu_forget_addrspace(as);
+	spl = splhigh();
+	if(curcpu->c_lastas == as) {
+		curcpu->c_lastas = NULL;
+	}
+	splx(spl);
 	
 	/* Free up region list */
 	while(region != NULL) {
 		tmpregion = region;
 		region = region->next;
+		if(tmpregion->vn != NULL) {
+			vfs_close(tmpregion->vn);
+		}
 		kfree(tmpregion);
 	}
-	//kfree(as->regions);
+	kfree(as->regions);
 	
 	/* Everything else */
 	kfree(as);
-	
-	(void)as;
-	
 }
 
 void
 as_activate(struct addrspace *as)
 {
-	vm_tlbshootdown_all();
+	int spl;
+
+	spl = splhigh();
 
-	(void)as;  // suppress warning until code gets written
+	/*
+	 * c_lastas names the address space whose translations may be
+	 * in this cpu's TLB; NULL means they could be anyone's. We
+	 * only flush when some other address space is activated.
+	 *
+	 * thread_switch does not call this for threads without an
+	 * address space, so a kernel thread runs on top of whatever
+	 * user entries are loaded (it never touches user addresses),
+	 * and switching back to the same process costs nothing.
+	 *
+	 * Activating NULL is only done by thread_exit, just before
+	 * as_destroy. The entries stay loaded, but with c_lastas
+	 * cleared the next activation of any address space, even a
+	 * new one allocated at the same address, flushes them first.
+	 */
+	if (as == NULL) {
+		KASSERT(curthread->t_addrspace == NULL);
+		curcpu->c_lastas = NULL;
+	}
+	else if (as != curcpu->c_lastas) {
+		vm_tlbshootdown_all();
+		curcpu->c_lastas = as;
+	}
+
+	splx(spl);
 }
 
 /*
@@ -203,48 +391,29 @@ as_activate(struct addrspace *as)
  * VADDR+MEMSIZE.
  *
  * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored. When you write the VM system, you may
- * want to implement them.
+ * write, or execute permission should be set on the segment.
+ * Writes to pages of a region without WRITEABLE fault.
+ *
+ * No memory is allocated here. The region is only recorded, and
+ * vm_fault calls as_load_page to allocate each page the first time
+ * it is touched.
  */
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		 int readable, int writeable, int executable)
 {
-	int n, i, index, err;
-	struct coremap_entry *page;
-	struct page_table_entry *pte;
+	int n, err;
+	vaddr_t base;
+
+	/* Align the region to page boundaries */
+	base = vaddr & PAGE_FRAME;
+	sz += vaddr - base;
 
-	/* Determine how many pages to allocate for this region */
+	/* Determine how many pages this region spans */
 	n = ROUNDUP(sz, PAGE_SIZE);
 	n = n / PAGE_SIZE;
 	
-	/* Allocate each page */
-	for(i = 0; i < n; i++) {
-		index = alloc_page();
-		if(index == -1) {
-			return ENOMEM;
-		}
-		page = &coremap[index]; /* Get pointer to coremap entry */
-			
-		if(!spinlock_do_i_hold(&coremap_lock)) {
-			spinlock_acquire(&coremap_lock);
-		}				
-		spinlock_acquire(&page->lock);
-			
-		pte = add_pte(as, page);/* Add entry to page table */
-		page->permissions = readable | writeable | executable;	/* Set page permission flags*/
-		page->as_vbase = vaddr;/* Update base virtual address that page corresponds to (for TLB management)*/
-		vaddr +=PAGE_SIZE;/* Increment base virtual address (for when a region takes up multiple pages)s*/
-		// modify additional fields here where necessary
-					
-		spinlock_release(&page->lock);
-		if(spinlock_do_i_hold(&coremap_lock)) {
-			spinlock_release(&coremap_lock);
-		}
-	}
-	
-	err = add_region(as, vaddr, n, readable | writeable | executable);
+	err = add_region(as, base, n, readable | writeable | executable);
 	if(err) {
 		panic("vm: could not add region to address space region list\n");
 	}
@@ -255,6 +424,46 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	return 0;
 }
 
+/*
+ * Find the region containing VADDR, or NULL if there is none.
+ */
+struct region *
+region_find(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *region;
+	
+	for(region = as->regions->firstregion; region != NULL; region = region->next) {
+		if((int)region->vaddr == -1) {
+			continue;
+		}
+		if(vaddr >= region->vaddr &&
+		   vaddr < region->vaddr + region->npages * PAGE_SIZE) {
+			return region;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Find a region overlapping the NPAGES pages from VADDR, or NULL.
+ */
+static struct region *
+region_overlapping(struct addrspace *as, vaddr_t vaddr, size_t npages)
+{
+	struct region *region;
+	
+	for(region = as->regions->firstregion; region != NULL; region = region->next) {
+		if((int)region->vaddr == -1) {
+			continue;
+		}
+		if(vaddr < region->vaddr + region->npages * PAGE_SIZE &&
+		   region->vaddr < vaddr + npages * PAGE_SIZE) {
+			return region;
+		}
+	}
+	return NULL;
+}
+
 int add_region(struct addrspace *as, vaddr_t vaddr, int npages, int permissions) {
 	struct region *region = as->regions->firstregion;
 	struct region *tmp;
@@ -270,47 +479,966 @@ int add_region(struct addrspace *as, vaddr_t vaddr, int npages, int permissions)
 	
 	if(region == NULL) {
 		region = kmalloc(sizeof(struct region));
-		tmp->next = region;
 		if(region == NULL) {
 			return ENOMEM;
 		}
+		region->next = NULL;
+		tmp->next = region;
 	}
 	
+	/* A reused node (e.g. after munmap) keeps its place in the list */
 	region->vaddr = vaddr;
 	region->npages = npages;
 	region->permissions = permissions;
-	region->next = NULL;
+	region->flags = 0;
+	region->vn = NULL;
+	region->file_offset = 0;
+	region->file_vaddr = vaddr;
+	region->file_size = 0;
+	
+	return 0;
+}
+
+/*
+ * Back the region containing VADDR with FILESIZE bytes of V starting
+ * at OFFSET, to be placed at VADDR. The address space keeps its own
+ * open reference to V until it is destroyed.
+ */
+int
+as_define_backing(struct addrspace *as, vaddr_t vaddr, struct vnode *v,
+                  off_t offset, size_t filesize)
+{
+	struct region *region;
+	
+	region = region_find(as, vaddr);
+	if(region == NULL) {
+		return EFAULT;
+	}
+	
+	VOP_INCOPEN(v);
+	VOP_INCREF(v);
+	if(region->vn != NULL) {
+		vfs_close(region->vn);
+	}
+	
+	region->vn = v;
+	region->file_offset = offset;
+	region->file_vaddr = vaddr;
+	region->file_size = filesize;
+	
+	return 0;
+}
+
+/*
+ * Union of the permissions of every region covering page VADDR,
+ * or -1 if there is none.
+ */
+static int
+as_page_permissions(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *region;
+	int permissions;
+	
+	permissions = -1;
+	for(region = as->regions->firstregion; region != NULL; region = region->next) {
+		if((int)region->vaddr == -1) {
+			continue;
+		}
+		if(vaddr >= region->vaddr &&
+		   vaddr < region->vaddr + region->npages * PAGE_SIZE) {
+			if(permissions == -1) {
+				permissions = 0;
+			}
+			permissions |= region->permissions;
+		}
+	}
+	return permissions;
+}
+
+/*
+ * True if VADDR in AS is out on swap in slot SLOT.
+ */
+static bool
+as_swapped_at(struct addrspace *as, vaddr_t vaddr, off_t slot)
+{
+	struct page_table_entry *pte;
+	
+	pte = pt_lookup(as->pages, vaddr);
+	return pte != NULL && pte->page == NULL && pte->is_on_disk &&
+	       pte->disk_locale == slot && as_page_permissions(as, vaddr) != -1;
+}
+
+/*
+ * Read page VADDR, described by PTE, back from swap into PAGE. The
+ * pages next to it that were swapped out to the neighbouring slots,
+ * most likely in the same cluster, are read in the same transfer and
+ * mapped straight away, unless memory is short. The caller maps PAGE.
+ */
+static void
+as_swap_in(struct addrspace *as, vaddr_t vaddr, struct page_table_entry *pte,
+           struct coremap_entry *page)
+{
+	struct coremap_entry *pages[SWAP_CLUSTER_MAX];
+	paddr_t pas[SWAP_CLUSTER_MAX];
+	struct page_table_entry *npte;
+	vaddr_t nvaddr;
+	off_t slot;
+	int i, n, nback, index;
+	
+	slot = pte->disk_locale;
+	
+	nback = 0;
+	n = 1;
+	if(!swap_memory_low()) {
+		while(n < SWAP_CLUSTER_MAX && vaddr >= (vaddr_t)(nback + 1) * PAGE_SIZE &&
+		      slot > (nback + 1) * PAGE_SIZE &&
+		      as_swapped_at(as, vaddr - (nback + 1) * PAGE_SIZE,
+		                    slot - (nback + 1) * PAGE_SIZE)) {
+			nback++;
+			n++;
+		}
+		while(n < SWAP_CLUSTER_MAX &&
+		      as_swapped_at(as, vaddr + (n - nback) * PAGE_SIZE,
+		                    slot + (n - nback) * PAGE_SIZE)) {
+			n++;
+		}
+	}
+	
+	/* Frames for the neighbours; give up on prefetching if short */
+	for(i = 0; i < n; i++) {
+		if(i == nback) {
+			pages[i] = page;
+			continue;
+		}
+		index = alloc_page();
+		if(index == -1) {
+			while(i-- > 0) {
+				if(i != nback) {
+					free_page(pages[i]->vbase);
+				}
+			}
+			nback = 0;
+			n = 1;
+			pages[0] = page;
+			break;
+		}
+		pages[i] = &coremap[index];
+	}
+	
+	for(i = 0; i < n; i++) {
+		pas[i] = pages[i]->pbase;
+		pages[i]->state = PAGE_CLEAN;
+	}
+	swap_in_cluster(pas, n, slot - nback * PAGE_SIZE);
+	pte->is_on_disk = false;
+	
+	for(i = 0; i < n; i++) {
+		if(i == nback) {
+			continue;
+		}
+		nvaddr = vaddr + (i - nback) * PAGE_SIZE;
+		npte = pt_lookup(as->pages, nvaddr);
+		
+		pages[i]->permissions = as_page_permissions(as, nvaddr);
+		npte->page = pages[i];
+		npte->is_on_disk = false;
+		
+		/* Not used yet, so first in line if memory runs short again */
+		spinlock_acquire(&pages[i]->lock);
+		pages[i]->referenced = false;
+		pages[i]->as = as;
+		pages[i]->as_vbase = nvaddr;
+		spinlock_release(&pages[i]->lock);
+	}
+}
+
+/*
+ * Decide whether page VADDR can come from the shared text cache: it
+ * must be read-only and start with data from exactly one file-backed
+ * region. If so, return the cache key in VN, OFFSET and LEN.
+ */
+static bool
+as_text_key(struct addrspace *as, vaddr_t vaddr, int permissions,
+            struct vnode **vn, off_t *offset, unsigned *len)
+{
+	struct region *region;
+	vaddr_t end;
+	int nfound;
+	
+	if(permissions & PAGE_WRITABLE) {
+		return false;
+	}
+	
+	nfound = 0;
+	for(region = as->regions->firstregion; region != NULL; region = region->next) {
+		if(region->vn == NULL || region->file_size == 0) {
+			continue;
+		}
+		end = region->file_vaddr + region->file_size;
+		if(end <= vaddr || region->file_vaddr >= vaddr + PAGE_SIZE) {
+			continue;
+		}
+		if(region->flags & REGION_MMAP) {
+			/* The file may be written behind the cache's back */
+			return false;
+		}
+		if(region->file_vaddr > vaddr) {
+			/* Partly zero-fill at the front; not worth sharing */
+			return false;
+		}
+		if(end > vaddr + PAGE_SIZE) {
+			end = vaddr + PAGE_SIZE;
+		}
+		*vn = region->vn;
+		*offset = region->file_offset + (vaddr - region->file_vaddr);
+		*len = end - vaddr;
+		nfound++;
+	}
+	return nfound == 1;
+}
+
+/*
+ * Is page VADDR all zeroes: never swapped out, and clear of the
+ * file-backed part of every region?
+ */
+static bool
+as_zero_fill(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *region;
+	struct page_table_entry *pte;
+	
+	pte = pt_lookup(as->pages, vaddr);
+	if(pte != NULL && pte->is_on_disk) {
+		return false;
+	}
+	
+	for(region = as->regions->firstregion; region != NULL; region = region->next) {
+		if(region->vn == NULL || region->file_size == 0) {
+			continue;
+		}
+		if(region->file_vaddr < vaddr + PAGE_SIZE &&
+		   vaddr < region->file_vaddr + region->file_size) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Fill freshly allocated, zeroed PAGE with the contents of page VADDR:
+ * from swap if it was evicted, otherwise from the file-backed part of
+ * every region overlapping it.
+ */
+static int
+as_fill_page(struct addrspace *as, vaddr_t vaddr, struct coremap_entry *page)
+{
+	struct region *region;
+	struct page_table_entry *pte;
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t start, end;
+	int result;
+	
+	pte = pt_lookup(as->pages, vaddr);
+	if(pte != NULL && pte->is_on_disk) {
+		/* Evicted earlier; its swap slot holds the contents */
+		as_swap_in(as, vaddr, pte, page);
+		return 0;
+	}
+	
+	for(region = as->regions->firstregion; region != NULL; region = region->next) {
+		if(region->vn == NULL || region->file_size == 0) {
+			continue;
+		}
+		
+		start = region->file_vaddr > vaddr ? region->file_vaddr : vaddr;
+		end = region->file_vaddr + region->file_size;
+		if(end > vaddr + PAGE_SIZE) {
+			end = vaddr + PAGE_SIZE;
+		}
+		if(start >= end) {
+			continue;
+		}
+		
+		uio_kinit(&iov, &ku, (void *)(page->vbase + (start - vaddr)), end - start,
+		          region->file_offset + (start - region->file_vaddr), UIO_READ);
+		result = VOP_READ(region->vn, &ku);
+		if(result) {
+			return result;
+		}
+		if(ku.uio_resid != 0 && !(region->flags & REGION_MMAP)) {
+			/* short read; problem with executable? */
+			kprintf("vm: short read on page 0x%x - file truncated?\n", vaddr);
+			return ENOEXEC;
+		}
+		if(region->flags & REGION_SHARED) {
+			/* Matches the file; the first write marks it dirty */
+			page->state = PAGE_CLEAN;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Materialize the page containing VADDR. The page starts out zeroed,
+ * then the file-backed part of every region overlapping it is read
+ * in, or it is read back from swap if it was evicted. Its permissions
+ * are the union of those regions' permissions.
+ *
+ * Read-only pages read straight from a file (program text, mostly)
+ * go through the text cache, so every address space running the
+ * same binary maps the same physical page.
+ *
+ * Unless WRITE is set, a page that would be all zeroes maps the
+ * shared zero page instead. A write to a page still mapping it
+ * replaces it with a real, private page.
+ *
+ * Returns EFAULT if no region covers VADDR, or if it is a write to
+ * the zero page in a read-only region.
+ */
+int
+as_load_page(struct addrspace *as, vaddr_t vaddr, bool write,
+             struct page_table_entry **ret)
+{
+	struct coremap_entry *page, *zero;
+	struct page_table_entry *pte;
+	struct vnode *vn;
+	off_t offset;
+	unsigned len;
+	int index, permissions, result;
+	bool shared, zerofill;
+	
+	vaddr &= PAGE_FRAME;
+	
+	permissions = as_page_permissions(as, vaddr);
+	if(permissions == -1) {
+		return EFAULT;
+	}
+	
+	zero = NULL;
+	pte = pt_lookup(as->pages, vaddr);
+	if(pte != NULL && pte->page == vm_zeropage) {
+		if(!(permissions & PAGE_WRITABLE)) {
+			return EFAULT;
+		}
+		zero = vm_zeropage;
+	}
+	
+	page = NULL;
+	shared = false;
+	zerofill = zero != NULL || as_zero_fill(as, vaddr);
+	if(!write && zero == NULL && zerofill) {
+		page = vm_zeropage;
+		spinlock_acquire(&page->lock);
+		page->refcount++;
+		spinlock_release(&page->lock);
+		vmstat_inc(VMSTAT_ZEROPAGE);
+	}
+	else {
+		shared = as_text_key(as, vaddr, permissions, &vn, &offset, &len);
+		if(shared) {
+			page = textcache_lookup(vn, offset, len, permissions);
+		}
+	}
+	
+	if(page == NULL) {
+		/* alloc_page hands back a zeroed page, which covers zero-fill */
+		index = alloc_page();
+		if(index == -1) {
+			return ENOMEM;
+		}
+		page = &coremap[index];
+		
+		if(zerofill) {
+			vmstat_inc(VMSTAT_ZEROFILL);
+		}
+		else {
+			result = as_fill_page(as, vaddr, page);
+			if(result) {
+				free_page(page->vbase);
+				return result;
+			}
+		}
+		
+		page->permissions = permissions;	/* Set page permission flags*/
+		
+		if(shared) {
+			page = textcache_insert(page, vn, offset, len);
+		}
+	}
+	
+	/* Add entry to page table */
+	pte = add_pte(as, vaddr, page);
+	if(pte == NULL) {
+		free_page(page->vbase);
+		return ENOMEM;
+	}
+	
+	/*
+	 * Only now that the page table points at it may the clock
+	 * consider the page for eviction. A page other address spaces
+	 * share keeps its owner; see vm_tlb_load.
+	 */
+	if(!spinlock_do_i_hold(&coremap_lock)) {
+		spinlock_acquire(&coremap_lock);
+	}				
+	spinlock_acquire(&page->lock);
+	
+	if(page->refcount == 1 && page->as == NULL) {
+		page->as = as;
+		page->as_vbase = vaddr;
+	}
+	
+	spinlock_release(&page->lock);
+	if(spinlock_do_i_hold(&coremap_lock)) {
+		spinlock_release(&coremap_lock);
+	}
+	
+	if(zero != NULL) {
+		/* Other cpus may still map the zero page here */
+		cpu_forget_addrspace(as);
+		free_page(zero->vbase);
+	}
+	
+	*ret = pte;
+	return 0;
+}
+
+/*
+ * Give back the page and swap slot ENTRY holds, leaving it empty.
+ * Waits for the page if it is being paged out.
+ */
+static void
+pte_release(struct addrspace *as, struct page_table_entry *entry)
+{
+	struct coremap_entry *page;
+	
+ again:
+	page = entry->page;
+	if(page != NULL) {
+		spinlock_acquire(&page->lock);
+		if(page->is_locked || entry->page != page) {
+			/* Let the pageout finish before tearing down */
+			spinlock_release(&page->lock);
+			vm_wait_busy(page);
+			goto again;
+		}
+		/* Make sure the clock never picks it for us again */
+		if(page->as == as) {
+			page->as = NULL;
+		}
+		spinlock_release(&page->lock);
+		entry->page = NULL;
+		free_page(page->vbase);
+	}
+	if(entry->disk_locale > 0) {
+		swap_free(entry->disk_locale);
+	}
+	entry->is_on_disk = false;
+	entry->disk_locale = 0;
+	entry->is_dirty = false;
+}
+
+/*
+ * Write the page at KVADDR, which holds page VADDR of REGION, to the
+ * region's file. Nothing past the current end of the file is
+ * written, so a mapping never grows its file.
+ */
+static int
+as_write_file(struct region *region, vaddr_t vaddr, vaddr_t kvaddr)
+{
+	struct iovec iov;
+	struct uio ku;
+	struct stat st;
+	off_t offset;
+	size_t len;
+	int result;
+	
+	offset = region->file_offset + (vaddr - region->file_vaddr);
+	len = region->file_vaddr + region->file_size - vaddr;
+	if(len > PAGE_SIZE) {
+		len = PAGE_SIZE;
+	}
+	
+	result = VOP_STAT(region->vn, &st);
+	if(result) {
+		return result;
+	}
+	if(offset >= st.st_size) {
+		return 0;
+	}
+	if(offset + (off_t)len > st.st_size) {
+		len = st.st_size - offset;
+	}
+	
+	uio_kinit(&iov, &ku, (void *)kvaddr, len, offset, UIO_WRITE);
+	return VOP_WRITE(region->vn, &ku);
+}
+
+/*
+ * Write every page of REGION that was modified back to its file, if
+ * it is a writable MAP_SHARED mapping. With CLEAN set the pages are
+ * marked clean, so writes after this are noticed; the caller must
+ * flush the TLB afterwards, since entries may still be writable.
+ * Pages still shared with a forked process stay dirty, since its TLB
+ * entries are not ours to flush; they are just written again later.
+ */
+static int
+as_writeback_region(struct addrspace *as, struct region *region, bool clean)
+{
+	struct page_table_entry *pte;
+	struct coremap_entry *page, *buf;
+	vaddr_t vaddr;
+	size_t i;
+	int index, result, err;
+	bool dirty, mark;
+	
+	if(!(region->flags & REGION_SHARED) || region->vn == NULL ||
+	   !(region->permissions & PAGE_WRITABLE)) {
+		return 0;
+	}
+	
+	err = 0;
+	for(i = 0; i < region->npages; i++) {
+		vaddr = region->vaddr + i * PAGE_SIZE;
+		pte = pt_lookup(as->pages, vaddr);
+		if(pte == NULL) {
+			continue;
+		}
+		
+	 again:
+		page = pte->page;
+		if(page != NULL) {
+			spinlock_acquire(&page->lock);
+			if(page->is_locked || pte->page != page) {
+				spinlock_release(&page->lock);
+				vm_wait_busy(page);
+				goto again;
+			}
+			dirty = pte->is_dirty || page->state == PAGE_DIRTY;
+			if(!dirty) {
+				spinlock_release(&page->lock);
+				continue;
+			}
+			/* Pin it so the pageout daemon leaves it alone */
+			mark = clean && page->refcount == 1;
+			page->refcount++;
+			if(mark) {
+				page->state = PAGE_CLEAN;
+			}
+			spinlock_release(&page->lock);
+			buf = page;
+			
+			if(mark && pte->disk_locale > 0) {
+				/* Older than the page; don't let eviction trust it */
+				swap_free(pte->disk_locale);
+				pte->disk_locale = 0;
+			}
+		}
+		else if(pte->is_on_disk && pte->is_dirty) {
+			index = alloc_page();
+			if(index == -1) {
+				err = ENOMEM;
+				continue;
+			}
+			buf = &coremap[index];
+			swap_to_mem(buf->pbase, pte->disk_locale);
+			mark = clean;
+		}
+		else {
+			continue;
+		}
+		
+		result = as_write_file(region, vaddr, buf->vbase);
+		if(result) {
+			err = result;
+		}
+		else if(mark) {
+			pte->is_dirty = false;
+		}
+		free_page(buf->vbase);
+	}
+	
+	return err;
+}
+
+/*
+ * Choose where an NPAGES-page mapping goes: the highest free range
+ * below the stack that is above every region loaded from the
+ * executable. Returns 0 if there is no room.
+ */
+static vaddr_t
+as_mmap_find(struct addrspace *as, size_t npages)
+{
+	struct region *region;
+	vaddr_t top, floor, base, end;
+	
+	top = USERSTACK - USERSTACK_NPAGES * PAGE_SIZE;
+	
+	floor = 0;
+	for(region = as->regions->firstregion; region != NULL; region = region->next) {
+		if((int)region->vaddr == -1 || (region->flags & REGION_MMAP)) {
+			continue;
+		}
+		end = region->vaddr + region->npages * PAGE_SIZE;
+		if(end <= top && end > floor) {
+			floor = end;
+		}
+	}
+	
+	base = top;
+	while(base >= floor + npages * PAGE_SIZE) {
+		base -= npages * PAGE_SIZE;
+		region = region_overlapping(as, base, npages);
+		if(region == NULL) {
+			return base;
+		}
+		/* Try again just below whatever is in the way */
+		base = region->vaddr;
+	}
+	return 0;
+}
+
+/*
+ * Add a region of LEN bytes for mmap with the given permissions and
+ * REGION_* FLAGS, at VADDR, or wherever there is room if VADDR is 0.
+ * If VN is not NULL the region is backed by VN from OFFSET; pages
+ * past the end of the file read as zeroes. Nothing is read in until
+ * the pages are touched. The address used is handed back in RET.
+ */
+int
+as_mmap(struct addrspace *as, vaddr_t vaddr, size_t len, int permissions,
+        int flags, struct vnode *vn, off_t offset, vaddr_t *ret)
+{
+	struct region *region;
+	size_t npages;
+	int result;
+	
+	npages = DIVROUNDUP(len, PAGE_SIZE);
+	if(npages == 0 || npages > USERSPACETOP / PAGE_SIZE) {
+		return EINVAL;
+	}
+	
+	if(vaddr == 0) {
+		vaddr = as_mmap_find(as, npages);
+		if(vaddr == 0) {
+			return ENOMEM;
+		}
+	}
+	else if((vaddr & ~PAGE_FRAME) != 0 ||
+	        vaddr + npages * PAGE_SIZE > USERSPACETOP ||
+	        vaddr + npages * PAGE_SIZE < vaddr) {
+		return EINVAL;
+	}
+	else if(region_overlapping(as, vaddr, npages) != NULL) {
+		/* We don't replace existing mappings */
+		return EINVAL;
+	}
+	
+	result = add_region(as, vaddr, npages, permissions);
+	if(result) {
+		return result;
+	}
+	region = region_find(as, vaddr);
+	region->flags = flags | REGION_MMAP;
+	
+	if(vn != NULL) {
+		result = as_define_backing(as, vaddr, vn, offset, npages * PAGE_SIZE);
+		if(result) {
+			region->vaddr = -1;
+			return result;
+		}
+	}
+	
+	*ret = vaddr;
+	return 0;
+}
+
+/*
+ * Remove the mmap regions in the LEN bytes from VADDR. Every region
+ * in the range must have been made by mmap and lie entirely inside
+ * it; we don't split regions. Shared file mappings are written back
+ * first.
+ */
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	struct region *region;
+	struct page_table_entry *pte;
+	vaddr_t end;
+	size_t i;
+	int spl, result, err;
+	
+	if((vaddr & ~PAGE_FRAME) != 0 || len == 0) {
+		return EINVAL;
+	}
+	end = vaddr + ROUNDUP(len, PAGE_SIZE);
+	if(end > USERSPACETOP || end < vaddr) {
+		return EINVAL;
+	}
+	
+	for(region = as->regions->firstregion; region != NULL; region = region->next) {
+		if((int)region->vaddr == -1 ||
+		   region->vaddr >= end || region->vaddr + region->npages * PAGE_SIZE <= vaddr) {
+			continue;
+		}
+		if(!(region->flags & REGION_MMAP) || region->vaddr < vaddr ||
+		   region->vaddr + region->npages * PAGE_SIZE > end) {
+			return EINVAL;
+		}
+	}
+	
+	err = 0;
+	for(region = as->regions->firstregion; region != NULL; region = region->next) {
+		if((int)region->vaddr == -1 || region->vaddr < vaddr || region->vaddr >= end) {
+			continue;
+		}
+		
+		result = as_writeback_region(as, region, false);
+		if(result) {
+			err = result;
+		}
+		
+		/*
+		 * Empty the page table entries but leave them allocated; the
+		 * pageout daemon may be looking at them while clustering.
+		 */
+		for(i = 0; i < region->npages; i++) {
+			pte = pt_lookup(as->pages, region->vaddr + i * PAGE_SIZE);
+			if(pte != NULL) {
+				pte_release(as, pte);
+			}
+		}
+		
+		if(region->vn != NULL) {
+			vfs_close(region->vn);
+			region->vn = NULL;
+		}
+		region->vaddr = -1;	/* Free for add_region to reuse */
+	}
+	
+	spl = splhigh();
+	vm_tlbshootdown_all();
+	splx(spl);
+	cpu_forget_addrspace(as);
+	
+	return err;
+}
+
+/*
+ * Write back every writable MAP_SHARED mapping of VN in AS, for
+ * fsync.
+ */
+int
+as_sync_vnode(struct addrspace *as, struct vnode *vn)
+{
+	struct region *region;
+	int spl, result, err;
+	
+	err = 0;
+	for(region = as->regions->firstregion; region != NULL; region = region->next) {
+		if((int)region->vaddr == -1 || region->vn != vn) {
+			continue;
+		}
+		result = as_writeback_region(as, region, true);
+		if(result) {
+			err = result;
+		}
+	}
+	
+	/* Pages written back are clean again; make writes fault */
+	spl = splhigh();
+	vm_tlbshootdown_all();
+	splx(spl);
+	cpu_forget_addrspace(as);
+	
+	return err;
+}
+
+/*
+ * Move the end of the heap to BRK. Growing only extends the region;
+ * the new pages are zero-filled as they are touched. Shrinking frees
+ * the pages (and swap slots) that fall off the end right away.
+ */
+int
+as_set_break(struct addrspace *as, vaddr_t brk)
+{
+	struct region *heap = as->heap_region;
+	struct page_table_entry *pte;
+	size_t npages, i;
+	int spl;
+	
+	if(heap == NULL || brk < as->heap_start) {
+		return EINVAL;
+	}
+	if(brk > USERSPACETOP) {
+		return ENOMEM;
+	}
+	npages = ROUNDUP(brk - as->heap_start, PAGE_SIZE) / PAGE_SIZE;
+	
+	if(npages > heap->npages) {
+		if(region_overlapping(as, heap->vaddr + heap->npages * PAGE_SIZE,
+		                      npages - heap->npages) != NULL) {
+			return ENOMEM;
+		}
+		heap->npages = npages;
+	}
+	else if(npages < heap->npages) {
+		/* Shrink first, so nothing can fault the pages back in */
+		i = heap->npages;
+		heap->npages = npages;
+		while(i-- > npages) {
+			pte = pt_lookup(as->pages, heap->vaddr + i * PAGE_SIZE);
+			if(pte != NULL) {
+				pte_release(as, pte);
+			}
+		}
+		
+		spl = splhigh();
+		vm_tlbshootdown_all();
+		splx(spl);
+		cpu_forget_addrspace(as);
+	}
+	
+	as->heap_end = brk;
+	as->n_heap_pages = npages;
 	
 	return 0;
 }
 
+/*
+ * Page table entries come from their own object cache. There is
+ * nothing to construct; add_pte fills them in.
+ */
+static struct kmem_cache pte_cache =
+	KMEM_CACHE_INITIALIZER("pte", sizeof(struct page_table_entry),
+			       NULL, NULL);
 
+/*
+ * Create an empty page table. Second-level tables are allocated
+ * lazily by pt_insert.
+ */
+struct page_table *
+pt_create(void) {
+	struct page_table *pt;
+	unsigned i;
+	
+	pt = kmalloc(sizeof(struct page_table));
+	if(pt == NULL) {
+		return NULL;
+	}
+	
+	for(i = 0; i < PT_L1_ENTRIES; i++) {
+		pt->pt_dir[i] = NULL;
+	}
+	
+	return pt;
+}
+
+/*
+ * Free a page table, including every page table entry still in it.
+ * The pages the entries refer to are not touched.
+ */
+void
+pt_destroy(struct page_table *pt) {
+	struct page_table_entry **l2;
+	unsigned l1i;
+	int l2i;
+	
+	for(l1i = 0; l1i < PT_L1_ENTRIES; l1i++) {
+		l2 = pt->pt_dir[l1i];
+		if(l2 == NULL) {
+			continue;
+		}
+		for(l2i = 0; l2i < PT_L2_ENTRIES; l2i++) {
+			if(l2[l2i] != NULL) {
+				kmem_cache_free(&pte_cache, l2[l2i]);
+			}
+		}
+		kfree(l2);
+	}
+	
+	kfree(pt);
+}
+
+/*
+ * Find the page table entry mapping the page that contains VADDR.
+ * Returns NULL if there is none.
+ */
 struct page_table_entry *
-add_pte(struct addrspace *as, struct coremap_entry *page) {
-	struct page_table_entry *entry = as->pages->firstentry;
+pt_lookup(struct page_table *pt, vaddr_t vaddr) {
+	struct page_table_entry **l2;
 	
-	if(entry->page == NULL) {
-		entry->page = page;
-		entry->is_on_disk = false;
-		entry->disk_locale = swap_alloc();
-		entry->next = NULL;
-		return entry;
+	if(vaddr >= USERSPACETOP) {
+		return NULL;
 	}
 	
-	/* Traverse to the end of the linked list */
-	while(entry->next != NULL) {
-		entry = entry->next;
+	l2 = pt->pt_dir[PT_L1_INDEX(vaddr)];
+	if(l2 == NULL) {
+		return NULL;
+	}
+	
+	return l2[PT_L2_INDEX(vaddr)];
+}
+
+/*
+ * Install PTE as the entry for the page containing VADDR, allocating
+ * the second-level table if this is the first page in its span.
+ */
+int
+pt_insert(struct page_table *pt, vaddr_t vaddr, struct page_table_entry *pte) {
+	struct page_table_entry **l2;
+	int i;
+	
+	KASSERT(vaddr < USERSPACETOP);
+	
+	l2 = pt->pt_dir[PT_L1_INDEX(vaddr)];
+	if(l2 == NULL) {
+		l2 = kmalloc(PT_L2_ENTRIES * sizeof(struct page_table_entry *));
+		if(l2 == NULL) {
+			return ENOMEM;
+		}
+		for(i = 0; i < PT_L2_ENTRIES; i++) {
+			l2[i] = NULL;
+		}
+		pt->pt_dir[PT_L1_INDEX(vaddr)] = l2;
+	}
+	
+	KASSERT(l2[PT_L2_INDEX(vaddr)] == NULL);
+	l2[PT_L2_INDEX(vaddr)] = pte;
+	
+	return 0;
+}
+
+/*
+ * Map PAGE at VADDR in the address space's page table. If an entry
+ * for VADDR already exists (e.g. the page was swapped out) it is
+ * reused.
+ */
+struct page_table_entry *
+add_pte(struct addrspace *as, vaddr_t vaddr, struct coremap_entry *page) {
+	struct page_table_entry *entry;
+	
+	entry = pt_lookup(as->pages, vaddr);
+	if(entry != NULL) {
+		entry->page = page;
+		return entry;
 	}
 	
 	/* Add the page table entry */
-	entry->next = kmalloc(sizeof(struct page_table_entry));
-	entry->next->prev = entry;
-	entry->next->next = NULL;
-	entry->next->page = page;
-	entry->next->is_on_disk = false;
-	entry->next->disk_locale = swap_alloc();
+	entry = kmem_cache_alloc(&pte_cache);
+	if(entry == NULL) {
+		return NULL;
+	}
+	entry->page = page;
+	entry->is_on_disk = false;
+	entry->disk_locale = 0;		/* assigned when first evicted */
+	entry->is_dirty = false;
 	
-	entry = entry->next;
+	if(pt_insert(as->pages, vaddr, entry)) {
+		kmem_cache_free(&pte_cache, entry);
+		return NULL;
+	}
 	
 	return entry;
 }
@@ -320,9 +1448,9 @@ as_prepare_load(struct addrspace *as)
 {
 
 	 /* 
-	  * Set permissions of each page to READ/WRITE to allow data
-	  * to be loaded into each segment of the address space.
-	  * i.e. arguments on the stack, the program code, etc.
+	  * Nothing to do. Segments are read in on demand by
+	  * as_load_page through the kernel mapping of each page, so
+	  * they never need to be made temporarily writable.
 	  */
 	(void)as;
 	return 0;
@@ -331,21 +1459,51 @@ as_prepare_load(struct addrspace *as)
 int
 as_complete_load(struct addrspace *as)
 {
+	struct region *region;
+	vaddr_t top;
+	int err;
+	
 	/*
-	 * Write this.
+	 * Start the heap, empty, on the first page past the highest
+	 * loaded segment. sbrk grows it from there.
 	 */
-
-	(void)as;
+	top = 0;
+	for(region = as->regions->firstregion; region != NULL; region = region->next) {
+		if((int)region->vaddr == -1) {
+			continue;
+		}
+		if(region->vaddr + region->npages * PAGE_SIZE > top) {
+			top = region->vaddr + region->npages * PAGE_SIZE;
+		}
+	}
+	
+	err = add_region(as, top, 0, PAGE_READABLE | PAGE_WRITABLE);
+	if(err) {
+		return err;
+	}
+	for(region = as->regions->firstregion; region->vaddr != top ||
+	    region->npages != 0; region = region->next);
+	region->flags = REGION_HEAP;
+	
+	as->heap_region = region;
+	as->heap_start = top;
+	as->heap_end = top;
+	as->n_heap_pages = 0;
+	
 	return 0;
 }
 
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
-	as_define_region(as, USERSTACK-12*PAGE_SIZE, 12*PAGE_SIZE,
-			PAGE_READABLE, PAGE_WRITABLE, PAGE_EXECUTABLE);
+	int result;
 
-	(void)as;
+	result = as_define_region(as, USERSTACK-USERSTACK_NPAGES*PAGE_SIZE,
+			USERSTACK_NPAGES*PAGE_SIZE,
+			PAGE_READABLE, PAGE_WRITABLE, PAGE_EXECUTABLE);
+	if(result) {
+		return result;
+	}
 
 	/* Initial user-level stack pointer */
 	*stackptr = USERSTACK;
@@ -29,8 +29,12 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <platform/maxcpus.h>
 
 /*
  * Kernel malloc.
@@ -87,6 +91,10 @@ static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
 #define SMALLEST_SUBPAGE_SIZE 16
 #define LARGEST_SUBPAGE_SIZE 2048
 
+/* Per-cpu magazine size, in blocks and roughly in bytes; see below */
+#define KMAG_MAX 16
+#define KMAG_BYTES 2048
+
 #elif PAGE_SIZE == 8192
 #error "No support for 8k pages (yet?)"
 #else
@@ -116,48 +124,54 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * This is cheesy. 
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
+ * Pagerefs for pages in the coremap live in a table indexed by
+ * coremap index, so finding a page's pageref from an address is
+ * O(1) and there is one for every page of physical memory. The table
+ * is set up by kmalloc_bootstrap once the coremap exists.
  *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
+ * Pages kmalloc gets before that (or ever, with dumbvm) use a fixed
+ * pool of one page's worth of pagerefs in the BSS, handed out from
+ * the top and recycled through a free list. Those are the only ones
+ * that ever have to be searched for.
  *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * A pageref that isn't in use has pageaddr_and_blocktype 0.
  */
 
-#define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
-static struct pageref pagerefs[NPAGEREFS];
+static struct pageref *pagereftable;
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
+#define NBOOTPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
+static struct pageref bootpagerefs[NBOOTPAGEREFS];
+static unsigned nbootpagerefs;		/* high water mark */
+static struct pageref *bootpagerefs_free;	/* chained by next_all */
+
+static
+bool
+isbootpageref(struct pageref *p)
+{
+	return p >= bootpagerefs && p < bootpagerefs + NBOOTPAGEREFS;
+}
 
 static
 struct pageref *
-allocpageref(void)
+allocpageref(vaddr_t prpage)
 {
-	unsigned i,j;
-	uint32_t k;
+	struct pageref *p;
+	int index;
+
+	index = get_coremap_index(prpage);
+	if (pagereftable != NULL && index != -1) {
+		p = &pagereftable[index];
+		KASSERT(p->pageaddr_and_blocktype == 0);
+		return p;
+	}
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
-			/* full */
-			continue;
-		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
-			}
-		}
-		KASSERT(0);
+	if (bootpagerefs_free != NULL) {
+		p = bootpagerefs_free;
+		bootpagerefs_free = p->next_all;
+		return p;
+	}
+	if (nbootpagerefs < NBOOTPAGEREFS) {
+		return &bootpagerefs[nbootpagerefs++];
 	}
 
 	/* ran out */
@@ -168,15 +182,34 @@ static
 void
 freepageref(struct pageref *p)
 {
-	size_t i, j;
-	uint32_t k;
-
-	j = p-pagerefs;
-	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
-	i = j/32;
-	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
+	p->pageaddr_and_blocktype = 0;
+	if (isbootpageref(p)) {
+		p->next_all = bootpagerefs_free;
+		bootpagerefs_free = p;
+	}
+}
+
+/*
+ * Find the pageref for the page PTRADDR is on without locking, if it
+ * is in the table. Safe as long as the caller owns a block on the
+ * page, which keeps the page from being given back.
+ */
+static
+struct pageref *
+tablepageref(vaddr_t ptraddr)
+{
+	struct pageref *p;
+	int index;
+
+	if (pagereftable == NULL) {
+		return NULL;
+	}
+	index = get_coremap_index(ptraddr);
+	if (index == -1) {
+		return NULL;
+	}
+	p = &pagereftable[index];
+	return p->pageaddr_and_blocktype != 0 ? p : NULL;
 }
 
 ////////////////////////////////////////
@@ -187,10 +220,9 @@ static struct pageref *allbase;
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the whole shared pool. Most kmallocs and kfrees
+ * never get this far, though: they are served from a per-cpu magazine
+ * (see below), and only move blocks to and from the pool in batches.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
@@ -258,14 +290,14 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
+			KASSERT(sc < NBOOTPAGEREFS + (unsigned)npages);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
+		KASSERT(ac < NBOOTPAGEREFS + (unsigned)npages);
 		ac++;
 	}
 
@@ -390,34 +422,36 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * Take up to N free blocks of size class BLKTYPE out of the shared
+ * pool, putting them in OBJS. Makes a fresh page if there are none
+ * at all. Returns how many blocks were taken; 0 means out of memory.
+ */
 static
-void *
-subpage_kmalloc(size_t sz)
+unsigned
+subpage_alloc_batch(unsigned blktype, void **objs, unsigned n)
 {
-	unsigned blktype;	// index into sizes[] that we're using
 	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
 	struct freelist *volatile fl;	// free list entry
-	void *retptr;		// our result
+	unsigned got;		// blocks taken so far
 
 	volatile int i;
 
-
-	blktype = blocktype(sz);
-	sz = sizes[blktype];
+	got = 0;
 
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
 
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
+	for (pr = sizebases[blktype]; pr != NULL && got < n; pr = pr->next_samesize) {
 
 		/* check for corruption */
 		KASSERT(PR_BLOCKTYPE(pr) == blktype);
 		checksubpage(pr);
 
-		if (pr->nfree > 0) {
+		while (pr->nfree > 0 && got < n) {
 
 		doalloc: /* comes here after getting a whole fresh page */
 
@@ -426,7 +460,7 @@ subpage_kmalloc(size_t sz)
 			fla = prpage + pr->freelist_offset;
 			fl = (struct freelist *)fla;
 
-			retptr = fl;
+			objs[got++] = fl;
 			fl = fl->next;
 			pr->nfree--;
 
@@ -440,14 +474,15 @@ subpage_kmalloc(size_t sz)
 				KASSERT(pr->nfree == 0);
 				pr->freelist_offset = INVALID_OFFSET;
 			}
-
-			checksubpages();
-
-			spinlock_release(&kmalloc_spinlock);
-			return retptr;
 		}
 	}
 
+	if (got > 0) {
+		checksubpages();
+		spinlock_release(&kmalloc_spinlock);
+		return got;
+	}
+
 	/*
 	 * No page of the right size available.
 	 * Make a new one.
@@ -462,17 +497,17 @@ subpage_kmalloc(size_t sz)
 	if (prpage==0) {
 		/* Out of memory. */
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n"); 
-		return NULL;
+		return 0;
 	}
 	spinlock_acquire(&kmalloc_spinlock);
 
-	pr = allocpageref();
+	pr = allocpageref(prpage);
 	if (pr==NULL) {
 		/* Couldn't allocate accounting space for the new page. */
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
 		kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
-		return NULL;
+		return 0;
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
@@ -506,63 +541,57 @@ subpage_kmalloc(size_t sz)
 	goto doalloc;
 }
 
+/*
+ * Check that PTR is a proper block of page PR, and fill it with
+ * 0xdeadbeef to make it easier to detect uses of dangling pointers.
+ */
 static
-int
-subpage_kfree(void *ptr)
+void
+subpage_checkfree(struct pageref *pr, void *ptr)
 {
-	int blktype;		// index into sizes[] that we're using
-	vaddr_t ptraddr;	// same as ptr
-	struct pageref *pr;	// pageref for page we're freeing in
-	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
-	vaddr_t offset;		// offset into page
-
-	ptraddr = (vaddr_t)ptr;
-
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
+	vaddr_t offset;
+	int blktype;
 
-	if (pr==NULL) {
-		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
-		return -1;
-	}
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype>=0 && blktype<NSIZES);
 
-	offset = ptraddr - prpage;
+	offset = (vaddr_t)ptr - PR_PAGEADDR(pr);
 
 	/* Check for proper positioning and alignment */
 	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
 		panic("kfree: subpage free of invalid addr %p\n", ptr);
 	}
 
-	/*
-	 * Clear the block to 0xdeadbeef to make it easier to detect
-	 * uses of dangling pointers.
-	 */
 	fill_deadbeef(ptr, sizes[blktype]);
+}
+
+/*
+ * Put checked block PTR back on the freelist of its page PR. Call
+ * with kmalloc_spinlock held. If the whole page is now free it is
+ * taken off the lists and its address returned, for the caller to
+ * free_kpages after dropping the lock; otherwise returns 0.
+ */
+static
+vaddr_t
+subpage_release(struct pageref *pr, void *ptr)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	struct freelist *fl;	// free list entry
+	vaddr_t offset;		// offset into page
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	offset = (vaddr_t)ptr - prpage;
 
 	/*
 	 * We probably ought to check for free twice by seeing if the block
 	 * is already on the free list. But that's expensive, so we don't.
 	 */
 
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
+	fl = (struct freelist *)ptr;
 	if (pr->freelist_offset == INVALID_OFFSET) {
 		fl->next = NULL;
 	} else {
@@ -576,21 +605,194 @@ subpage_kfree(void *ptr)
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
 		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+		return prpage;
 	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
+	return 0;
+}
+
+/*
+ * Find the pageref for the page PTRADDR is on, or NULL if it isn't on
+ * any of our pages. Only pages with boot pagerefs need searching for.
+ * Call with kmalloc_spinlock held.
+ */
+static
+struct pageref *
+subpage_lookup(vaddr_t ptraddr)
+{
+	struct pageref *pr;	// pageref for page we're looking in
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	pr = tablepageref(ptraddr);
+	if (pr != NULL) {
+		return pr;
 	}
 
-#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
+	for (i=0; i<nbootpagerefs; i++) {
+		pr = &bootpagerefs[i];
+		if (pr->pageaddr_and_blocktype == 0) {
+			continue;
+		}
+
+		/* check for corruption */
+		KASSERT(PR_BLOCKTYPE(pr) < NSIZES);
+		checksubpage(pr);
+
+		prpage = PR_PAGEADDR(pr);
+		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
+			return pr;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Give the N blocks in OBJS, already checked, back to the shared pool
+ * under one acquisition of the lock.
+ */
+static
+void
+subpage_free_batch(void **objs, unsigned n)
+{
+	vaddr_t freepages[KMAG_MAX];
+	unsigned i, nfreepages;
+	struct pageref *pr;
+	vaddr_t prpage;
+
+	KASSERT(n <= KMAG_MAX);
+
+	nfreepages = 0;
 	spinlock_acquire(&kmalloc_spinlock);
+	for (i=0; i<n; i++) {
+		pr = subpage_lookup((vaddr_t)objs[i]);
+		KASSERT(pr != NULL);
+		prpage = subpage_release(pr, objs[i]);
+		if (prpage != 0) {
+			freepages[nfreepages++] = prpage;
+		}
+	}
 	checksubpages();
 	spinlock_release(&kmalloc_spinlock);
-#endif
 
-	return 0;
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
+	}
+}
+
+////////////////////////////////////////
+//
+// Per-cpu magazines.
+//
+// Each cpu keeps a small stack of free blocks of every size class in
+// front of the shared pool. kmalloc pops from it and kfree pushes onto
+// it without taking any lock; only when a magazine runs empty (or
+// full) is kmalloc_spinlock taken, to move half a magazine's worth of
+// blocks in (or out) at once.
+//
+// Magazines hold about KMAG_BYTES of each size, up to KMAG_MAX blocks,
+// so a cpu never sits on more than a page or two of small blocks.
+// Blocks in a magazine count as allocated as far as their page is
+// concerned, so kheap_printstats shows them as in use.
+//
+
+static struct kmag {
+	unsigned km_count;
+	void *km_objs[KMAG_MAX];
+} kmags[MAXCPUS][NSIZES];
+
+static
+unsigned
+kmag_capacity(unsigned blktype)
+{
+	unsigned n;
+
+	n = KMAG_BYTES / sizes[blktype];
+	if (n > KMAG_MAX) {
+		n = KMAG_MAX;
+	}
+	return n > 0 ? n : 1;
+}
+
+static
+void *
+kmag_get(unsigned blktype)
+{
+	void *objs[KMAG_MAX];
+	struct kmag *km;
+	unsigned cap, n;
+	void *ret;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		/* Too early in boot for per-cpu state; use the pool */
+		n = subpage_alloc_batch(blktype, objs, 1);
+		return n > 0 ? objs[0] : NULL;
+	}
+
+	spl = splhigh();
+	km = &kmags[curcpu->c_number][blktype];
+	if (km->km_count > 0) {
+		ret = km->km_objs[--km->km_count];
+		splx(spl);
+		return ret;
+	}
+	splx(spl);
+
+	/* Empty; refill from the pool with interrupts back on */
+	cap = kmag_capacity(blktype);
+	n = subpage_alloc_batch(blktype, objs, (cap + 1) / 2);
+	if (n == 0) {
+		return NULL;
+	}
+	ret = objs[--n];
+
+	/* We may be on another cpu by now; that's fine */
+	spl = splhigh();
+	km = &kmags[curcpu->c_number][blktype];
+	while (n > 0 && km->km_count < cap) {
+		km->km_objs[km->km_count++] = objs[--n];
+	}
+	splx(spl);
+
+	if (n > 0) {
+		subpage_free_batch(objs, n);
+	}
+	return ret;
+}
+
+static
+void
+kmag_put(unsigned blktype, void *ptr)
+{
+	void *objs[KMAG_MAX];
+	struct kmag *km;
+	unsigned cap, n;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		subpage_free_batch(&ptr, 1);
+		return;
+	}
+
+	cap = kmag_capacity(blktype);
+	n = 0;
+
+	spl = splhigh();
+	km = &kmags[curcpu->c_number][blktype];
+	if (km->km_count == cap) {
+		/* Full; send the older half back to the pool */
+		n = (cap + 1) / 2;
+		km->km_count -= n;
+		memcpy(objs, &km->km_objs[km->km_count], n * sizeof(void *));
+	}
+	km->km_objs[km->km_count++] = ptr;
+	splx(spl);
+
+	if (n > 0) {
+		subpage_free_batch(objs, n);
+	}
 }
 
 //
@@ -603,9 +805,19 @@ kmalloc(size_t sz)
 		unsigned long npages;
 		vaddr_t address;
 
-		/* Round up to a whole number of pages. */
+		/*
+		 * Round up to a whole number of pages. More than one
+		 * page is mapped into kseg2 so that it needn't be
+		 * physically contiguous; before the VM system is up,
+		 * memory is still contiguous anyway.
+		 */
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
-		address = alloc_kpages(npages);
+		if (npages > 1 && vm_bootstrapped) {
+			address = kva_alloc(npages);
+		}
+		else {
+			address = alloc_kpages(npages);
+		}
 		if (address==0) {
 			return NULL;
 		}
@@ -613,20 +825,68 @@ kmalloc(size_t sz)
 		return (void *)address;
 	}
 
-	return subpage_kmalloc(sz);
+	return kmag_get(blocktype(sz));
 }
 
 void
 kfree(void *ptr)
 {
-	/*
-	 * Try subpage first; if that fails, assume it's a big allocation.
-	 */
+	struct pageref *pr;
+
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+
+	if ((vaddr_t)ptr >= MIPS_KSEG2) {
+		kva_free((vaddr_t)ptr);
+		return;
+	}
+
+	/*
+	 * Find out whether it's on a subpage page, and which. If it
+	 * isn't, assume it's a big allocation.
+	 */
+	pr = tablepageref((vaddr_t)ptr);
+	if (pr == NULL) {
+		spinlock_acquire(&kmalloc_spinlock);
+		pr = subpage_lookup((vaddr_t)ptr);
+		spinlock_release(&kmalloc_spinlock);
+	}
+	if (pr == NULL) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
+		return;
 	}
+
+	subpage_checkfree(pr, ptr);
+	kmag_put(PR_BLOCKTYPE(pr), ptr);
 }
 
+/*
+ * Set up the pageref table, now that the coremap exists. Called from
+ * vm_bootstrap. Pages already in use keep their boot pagerefs.
+ */
+void
+kmalloc_bootstrap(void)
+{
+	struct pageref *table;
+	unsigned long tablepages;
+	int i;
+
+	KASSERT(npages > 0);
+	KASSERT(pagereftable == NULL);
+
+	tablepages = (npages * sizeof(struct pageref) + PAGE_SIZE - 1)
+		/ PAGE_SIZE;
+	table = (struct pageref *)alloc_kpages(tablepages);
+	if (table == NULL) {
+		panic("kmalloc: no memory for pageref table\n");
+	}
+	for (i=0; i<npages; i++) {
+		table[i].pageaddr_and_blocktype = 0;
+	}
+
+	spinlock_acquire(&kmalloc_spinlock);
+	pagereftable = table;
+	spinlock_release(&kmalloc_spinlock);
+}
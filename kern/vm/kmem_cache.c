@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <kmem_cache.h>
+
+/*
+ * Object caches; see kmem_cache.h.
+ *
+ * Free objects sit first on a small per-cpu stack, reached with
+ * interrupts off and no lock; past that, in a shared depot under the
+ * cache's spinlock; and past that they are destroyed. Allocation
+ * looks in the same places in the same order before constructing a
+ * new object. Before curthread exists (early in boot) the per-cpu
+ * stacks are skipped.
+ */
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_cache_cpu *kcc;
+	void *obj;
+	int spl, result;
+
+	if (CURCPU_EXISTS()) {
+		spl = splhigh();
+		kcc = &kc->kc_cpus[curcpu->c_number];
+		if (kcc->kcc_count > 0) {
+			obj = kcc->kcc_objs[--kcc->kcc_count];
+			splx(spl);
+			return obj;
+		}
+		splx(spl);
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	if (kc->kc_ndepot > 0) {
+		obj = kc->kc_depot[--kc->kc_ndepot];
+		spinlock_release(&kc->kc_lock);
+		return obj;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	obj = kmalloc(kc->kc_size);
+	if (obj == NULL) {
+		return NULL;
+	}
+	if (kc->kc_ctor != NULL) {
+		result = kc->kc_ctor(obj);
+		if (result) {
+			kfree(obj);
+			return NULL;
+		}
+	}
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_cache_cpu *kcc;
+	int spl;
+
+	if (obj == NULL) {
+		return;
+	}
+
+	if (CURCPU_EXISTS()) {
+		spl = splhigh();
+		kcc = &kc->kc_cpus[curcpu->c_number];
+		if (kcc->kcc_count < KMEM_CACHE_DEPTH) {
+			kcc->kcc_objs[kcc->kcc_count++] = obj;
+			splx(spl);
+			return;
+		}
+		splx(spl);
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	if (kc->kc_ndepot < KMEM_CACHE_DEPOT) {
+		kc->kc_depot[kc->kc_ndepot++] = obj;
+		spinlock_release(&kc->kc_lock);
+		return;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	if (kc->kc_dtor != NULL) {
+		kc->kc_dtor(obj);
+	}
+	kfree(obj);
+}
@@ -1,12 +1,17 @@
+
 #include <types.h>
+#include <kern/errno.h>
 #include <kern/fcntl.h>
 #include <kern/stat.h>
 #include <lib.h>
+#include <cpu.h>
 #include <uio.h>
 #include <bitmap.h>
 #include <synch.h>
+#include <wchan.h>
 #include <thread.h>
 #include <current.h>
+#include <clock.h>
 #include <mainbus.h>
 #include <addrspace.h>
 #include <vm.h>
@@ -24,17 +29,42 @@ static unsigned long num_swap_pages;
 static struct bitmap *swap_map;
 static struct lock *swap_lock;
 
+/* Where the next search for free slots starts. */
+static unsigned swap_hint;
+
+/*
+ * Pageout daemon. It sleeps on pageout_wchan until the number of free
+ * pages drops below pageout_lowater, then evicts pages until there are
+ * pageout_hiwater free pages again.
+ */
+static struct wchan *pageout_wchan;
+static int pageout_lowater;
+static int pageout_hiwater;
+
+static void pageout_thread(void *unused1, unsigned long unused2);
+
 void
 swap_bootstrap(void)
 {
 	struct stat st;
-	size_t memsize;
 	char path[sizeof(swapdiskname)];
-
-	memsize = mainbus_ramsize();
+	int result;
+
+	/* Keep between 1/16 and 1/8 of memory free, but at least a few pages. */
+	pageout_lowater = npages / 16;
+	if (pageout_lowater < CPU_PAGECACHE_MAX) {
+		pageout_lowater = CPU_PAGECACHE_MAX;
+	}
+	pageout_hiwater = pageout_lowater * 2;
 	
 	strcpy(path, swapdiskname);
-	vfs_open(path, O_RDWR, 0, &swapnode);
+	result = vfs_open(path, O_RDWR, 0, &swapnode);
+	if (result) {
+		kprintf("swap: cannot open %s: %s; paging disabled\n",
+			swapdiskname, strerror(result));
+		swapnode = NULL;
+		return;
+	}
 	VOP_STAT(swapnode, &st);
 
 	num_swap_pages = st.st_size / PAGE_SIZE;
@@ -43,23 +73,77 @@ swap_bootstrap(void)
 	
 	swap_lock = lock_create("swaplock");
 
+	/* Slot 0 is reserved so that a disk address of 0 means "none". */
 	bitmap_mark(swap_map, 0);
+
+	pageout_wchan = wchan_create("pageout");
+	if (pageout_wchan == NULL) {
+		panic("swap: could not create pageout wchan\n");
+	}
+
+	result = thread_fork("pageout", pageout_thread, NULL, 0, NULL);
+	if (result) {
+		panic("swap: could not start pageout thread: %s\n",
+		      strerror(result));
+	}
 }
 
-/* Allocates a fixed space on disk to swap to. */
+/*
+ * Allocates a fixed space on disk to swap to. Returns -1 if swap is
+ * full or there is no swap disk.
+ */
 off_t
 swap_alloc(void)
 {
-	uint32_t index;
+	return swap_alloc_cluster(1);
+}
+
+/*
+ * Allocates N consecutive slots on disk, so that N pages can be moved
+ * in a single transfer. Returns the disk address of the first, or -1
+ * if there is no run of N free slots.
+ */
+off_t
+swap_alloc_cluster(unsigned n)
+{
+	unsigned i, index, run;
 	off_t returnoff;
 
+	KASSERT(n > 0 && n <= SWAP_CLUSTER_MAX);
+
+	if (swap_map == NULL) {
+		return -1;
+	}
+
 	lock_acquire(swap_lock);
 
-	bitmap_alloc(swap_map, &index);
+	/*
+	 * Next fit. Slot 0 is always marked, so a run can never wrap
+	 * around the end of the disk.
+	 */
+	returnoff = -1;
+	run = 0;
+	for (i = 0; i < num_swap_pages; i++) {
+		index = (swap_hint + i) % num_swap_pages;
+		if (index == 0 || bitmap_isset(swap_map, index)) {
+			run = 0;
+			continue;
+		}
+		if (++run < n) {
+			continue;
+		}
+
+		index -= n - 1;
+		for (run = 0; run < n; run++) {
+			bitmap_mark(swap_map, index + run);
+		}
+		swap_hint = index + n;
+		returnoff = (off_t)index * PAGE_SIZE;
+		break;
+	}
 
 	lock_release(swap_lock);
 
-	returnoff = index * PAGE_SIZE;
 	return returnoff;
 }
 
@@ -78,27 +162,141 @@ swap_free(off_t swap_addr)
 	lock_release(swap_lock);
 }
 
+/*
+ * Move N physical pages PAS[0..N-1] to or from the N consecutive
+ * slots starting at SWAP_ADDR, as one transfer.
+ */
+static
+void
+swap_io(const paddr_t *pas, unsigned n, off_t swap_addr, enum uio_rw rw)
+{
+	struct iovec iov[SWAP_CLUSTER_MAX];
+	struct uio ku;
+	unsigned i;
+	int result;
+
+	KASSERT(swapnode != NULL);
+	KASSERT(swap_addr > 0);
+	KASSERT(n > 0 && n <= SWAP_CLUSTER_MAX);
+
+	for (i = 0; i < n; i++) {
+		iov[i].iov_kbase = (void *)PADDR_TO_KVADDR(pas[i]);
+		iov[i].iov_len = PAGE_SIZE;
+	}
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = n;
+	ku.uio_offset = swap_addr;
+	ku.uio_resid = n * PAGE_SIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = rw;
+	ku.uio_space = NULL;
+
+	if (rw == UIO_READ) {
+		vmstat_add(VMSTAT_SWAPIN, n);
+		result = VOP_READ(swapnode, &ku);
+	}
+	else {
+		vmstat_add(VMSTAT_SWAPOUT, n);
+		result = VOP_WRITE(swapnode, &ku);
+	}
+	if (result) {
+		panic("swap: %s of %u pages at 0x%llx failed: %s\n",
+		      rw == UIO_READ ? "read" : "write", n,
+		      (unsigned long long)swap_addr, strerror(result));
+	}
+	KASSERT(ku.uio_resid == 0);
+}
 
+/*
+ * Read the page at SWAP_ADDR on the swap disk into physical page PA.
+ */
 void swap_to_mem(paddr_t pa, off_t swap_addr)
 {
-	(void)pa;
-	(void)swap_addr;
+	swap_io(&pa, 1, swap_addr, UIO_READ);
 }
 
+/*
+ * Write physical page PA out to SWAP_ADDR on the swap disk.
+ */
 void swap_to_disk(paddr_t pa, off_t swap_addr)
 {
-	(void)pa;
-	(void)swap_addr;
+	swap_io(&pa, 1, swap_addr, UIO_WRITE);
 }
 
+/*
+ * Read N consecutive slots starting at SWAP_ADDR into pages PAS.
+ */
+void swap_in_cluster(const paddr_t *pas, unsigned n, off_t swap_addr)
+{
+	swap_io(pas, n, swap_addr, UIO_READ);
+}
 
+/*
+ * Write pages PAS out to N consecutive slots starting at SWAP_ADDR.
+ */
+void swap_out_cluster(const paddr_t *pas, unsigned n, off_t swap_addr)
+{
+	swap_io(pas, n, swap_addr, UIO_WRITE);
+}
 
+/*
+ * Free pages, counting the ones parked in per-cpu magazines and
+ * zero pools, which any allocation can still have.
+ */
+static
+int
+swap_freepages(void)
+{
+	return nfreepages + (int)cpu_pooled_pages();
+}
 
+/*
+ * True if free memory is below the pageout daemon's low watermark,
+ * in which case speculative work like prefetching should be skipped.
+ */
+bool
+swap_memory_low(void)
+{
+	return swap_freepages() < pageout_lowater;
+}
 
+/*
+ * Poke the pageout daemon if free memory has dropped below the low
+ * watermark. Safe to call with spinlocks held.
+ */
+void
+swap_pageout_wakeup(void)
+{
+	if (pageout_wchan != NULL && swap_freepages() < pageout_lowater) {
+		wchan_wakeone(pageout_wchan);
+	}
+}
 
-
-
-
-
-
-
+static
+void
+pageout_thread(void *unused1, unsigned long unused2)
+{
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		wchan_lock(pageout_wchan);
+		if (swap_freepages() >= pageout_lowater) {
+			wchan_sleep(pageout_wchan);
+			continue;
+		}
+		wchan_unlock(pageout_wchan);
+
+		while (swap_freepages() < pageout_hiwater) {
+			if (vm_evict_page()) {
+				/*
+				 * Nothing evictable right now (everything
+				 * is kernel, shared or busy). Back off for
+				 * a while instead of spinning.
+				 */
+				clocksleep(1);
+				break;
+			}
+		}
+	}
+}
@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vnode.h>
+#include <vm.h>
+
+/*
+ * Cache of read-only pages read in from executables, so that every
+ * address space running the same binary maps the same physical
+ * pages. A page is identified by its vnode, the file offset at its
+ * start, how many bytes of it come from the file (the rest is
+ * zero), and its permissions.
+ *
+ * Cached pages are chained through their coremap entries, and live
+ * exactly as long as something maps them: the last free_page takes
+ * the page out of the cache. Taking a new reference from the cache
+ * and dropping the last one both happen under textcache_lock, so a
+ * lookup can never resurrect a page that is being freed.
+ */
+#define TEXTCACHE_BUCKETS 64
+
+static struct spinlock textcache_lock = SPINLOCK_INITIALIZER;
+static int textcache_buckets[TEXTCACHE_BUCKETS];
+static bool textcache_ready;
+
+static
+unsigned
+textcache_hash(struct vnode *vn, off_t offset)
+{
+	return ((uintptr_t)vn / sizeof(void *) + offset / PAGE_SIZE)
+		% TEXTCACHE_BUCKETS;
+}
+
+/*
+ * Find a page matching the key in the cache and take a reference to
+ * it. Call with textcache_lock held.
+ */
+static
+struct coremap_entry *
+textcache_find(struct vnode *vn, off_t offset, unsigned len, int permissions)
+{
+	struct coremap_entry *page;
+	int i;
+
+	if (!textcache_ready) {
+		for (i = 0; i < TEXTCACHE_BUCKETS; i++) {
+			textcache_buckets[i] = -1;
+		}
+		textcache_ready = true;
+	}
+
+	for (i = textcache_buckets[textcache_hash(vn, offset)]; i != -1;
+	     i = coremap[i].text_next) {
+		page = &coremap[i];
+		if (page->text_vn == vn && page->text_offset == offset &&
+		    page->text_len == len && page->permissions == permissions) {
+			spinlock_acquire(&page->lock);
+			KASSERT(page->refcount > 0);
+			page->refcount++;
+			spinlock_release(&page->lock);
+			return page;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Look up the page holding LEN bytes of VN from OFFSET. Returns it
+ * with a new reference, or NULL if it is not cached.
+ */
+struct coremap_entry *
+textcache_lookup(struct vnode *vn, off_t offset, unsigned len, int permissions)
+{
+	struct coremap_entry *page;
+
+	spinlock_acquire(&textcache_lock);
+	page = textcache_find(vn, offset, len, permissions);
+	spinlock_release(&textcache_lock);
+
+	return page;
+}
+
+/*
+ * Offer freshly read PAGE to the cache under the given key. If
+ * somebody else cached the same contents in the meantime, PAGE is
+ * freed and theirs is returned instead, with a new reference.
+ */
+struct coremap_entry *
+textcache_insert(struct coremap_entry *page, struct vnode *vn, off_t offset,
+		 unsigned len)
+{
+	struct coremap_entry *other;
+	unsigned bucket;
+	int index;
+
+	spinlock_acquire(&textcache_lock);
+
+	other = textcache_find(vn, offset, len, page->permissions);
+	if (other != NULL) {
+		spinlock_release(&textcache_lock);
+		free_page(page->vbase);
+		return other;
+	}
+
+	index = page - coremap;
+	bucket = textcache_hash(vn, offset);
+	page->text_vn = vn;
+	page->text_offset = offset;
+	page->text_len = len;
+	page->text_next = textcache_buckets[bucket];
+	textcache_buckets[bucket] = index;
+
+	spinlock_release(&textcache_lock);
+
+	return page;
+}
+
+/*
+ * Drop a reference to cached PAGE, taking it out of the cache if it
+ * was the last one. Returns true if the page should now be freed.
+ * Called by free_page.
+ */
+bool
+textcache_release(struct coremap_entry *page)
+{
+	unsigned bucket;
+	int index, *link;
+	bool last;
+
+	spinlock_acquire(&textcache_lock);
+	spinlock_acquire(&page->lock);
+
+	KASSERT(page->refcount > 0);
+	page->refcount--;
+	last = page->refcount == 0;
+
+	spinlock_release(&page->lock);
+
+	if (last) {
+		index = page - coremap;
+		bucket = textcache_hash(page->text_vn, page->text_offset);
+		for (link = &textcache_buckets[bucket]; *link != index;
+		     link = &coremap[*link].text_next) {
+			KASSERT(*link != -1);
+		}
+		*link = page->text_next;
+		page->text_vn = NULL;
+		page->text_next = -1;
+	}
+
+	spinlock_release(&textcache_lock);
+
+	return last;
+}
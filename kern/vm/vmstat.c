@@ -0,0 +1,258 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <uio.h>
+#include <vfs.h>
+#include <device.h>
+#include <vm.h>
+#include <platform/maxcpus.h>
+
+/*
+ * VM statistics.
+ *
+ * Each cpu bumps its own row of counters, so counting never takes a
+ * lock or bounces a cache line between cpus; the rows are only summed
+ * when somebody asks. Coremap page counts are not kept at all, but
+ * worked out from the coremap on demand.
+ *
+ * The report is printed by the "vm" menu command, and can be read by
+ * user programs from the "vmstat:" device.
+ */
+
+static unsigned vmstat_counts[MAXCPUS][VMSTAT_NCOUNTERS];
+
+static const char *const vmstat_names[VMSTAT_NCOUNTERS] = {
+	"TLB refills",
+	"Read faults",
+	"Write faults",
+	"Read-only faults",
+	"Zero page mappings",
+	"Zero-filled pages",
+	"Copy-on-write copies",
+	"Pages swapped in",
+	"Pages swapped out",
+};
+
+/*
+ * Add N to counter WHICH for the current cpu.
+ */
+void
+vmstat_add(unsigned which, unsigned n)
+{
+	int spl;
+
+	KASSERT(which < VMSTAT_NCOUNTERS);
+
+	/* Don't get moved to another cpu halfway through */
+	spl = splhigh();
+	vmstat_counts[curcpu->c_number][which] += n;
+	splx(spl);
+}
+
+/*
+ * Write the report into BUF, which is LEN bytes long. Returns the
+ * length of the report, which is truncated if it doesn't fit.
+ */
+static
+size_t
+vmstat_format(char *buf, size_t len)
+{
+	unsigned total, i, cpu;
+	unsigned nfree, nkernel, nuser, ncached;
+	size_t pos;
+	int j;
+
+	pos = 0;
+	for (i = 0; i < VMSTAT_NCOUNTERS; i++) {
+		total = 0;
+		for (cpu = 0; cpu < MAXCPUS; cpu++) {
+			total += vmstat_counts[cpu][i];
+		}
+		pos += snprintf(buf + pos, len - pos, "%-24s %u\n",
+				vmstat_names[i], total);
+		if (pos >= len) {
+			return len - 1;
+		}
+	}
+
+	/*
+	 * Pages that are not free but have no owner are sitting in a
+	 * per-cpu magazine or pool, ready to be handed out.
+	 */
+	nfree = nkernel = nuser = ncached = 0;
+	if (vm_bootstrapped) {
+		for (j = 0; j < npages; j++) {
+			if (coremap[j].is_free) {
+				nfree++;
+			}
+			else if (coremap[j].is_permanent) {
+				nkernel++;
+			}
+			else if (coremap[j].refcount > 0) {
+				nuser++;
+			}
+			else {
+				ncached++;
+			}
+		}
+	}
+	pos += snprintf(buf + pos, len - pos,
+			"%-24s %d\n%-24s %u\n%-24s %u\n%-24s %u\n%-24s %u\n",
+			"Coremap pages", npages,
+			"  free", nfree,
+			"  cached free", ncached,
+			"  kernel", nkernel,
+			"  user", nuser);
+	if (pos >= len) {
+		return len - 1;
+	}
+
+	return pos;
+}
+
+#define VMSTAT_REPORTSIZE 1024
+
+/*
+ * Print the report on the console.
+ */
+void
+vmstat_print(void)
+{
+	char *buf;
+
+	buf = kmalloc(VMSTAT_REPORTSIZE);
+	if (buf == NULL) {
+		kprintf("vmstat: out of memory\n");
+		return;
+	}
+	vmstat_format(buf, VMSTAT_REPORTSIZE);
+	kprintf("%s", buf);
+	kfree(buf);
+}
+
+/*
+ * The vmstat: device. Each read from offset 0 gets a fresh copy of
+ * the report, so cat vmstat: shows the numbers as of now.
+ */
+
+static
+int
+vmstat_open(struct device *dev, int openflags)
+{
+	(void)dev;
+
+	if (openflags != O_RDONLY) {
+		return EIO;
+	}
+	return 0;
+}
+
+static
+int
+vmstat_close(struct device *dev)
+{
+	(void)dev;
+	return 0;
+}
+
+static
+int
+vmstat_io(struct device *dev, struct uio *uio)
+{
+	char *buf;
+	size_t len;
+	int result;
+
+	(void)dev;
+
+	if (uio->uio_rw != UIO_READ) {
+		return EIO;
+	}
+
+	buf = kmalloc(VMSTAT_REPORTSIZE);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+	len = vmstat_format(buf, VMSTAT_REPORTSIZE);
+
+	result = 0;
+	if (uio->uio_offset < (off_t)len) {
+		result = uiomove(buf + uio->uio_offset, len - uio->uio_offset,
+				 uio);
+	}
+
+	kfree(buf);
+	return result;
+}
+
+static
+int
+vmstat_ioctl(struct device *dev, int op, userptr_t data)
+{
+	(void)dev;
+	(void)op;
+	(void)data;
+	return EIOCTL;
+}
+
+/*
+ * Attach the vmstat: device.
+ */
+void
+vmstat_bootstrap(void)
+{
+	struct device *dev;
+	int result;
+
+	dev = kmalloc(sizeof(*dev));
+	if (dev == NULL) {
+		panic("vmstat: could not add device: out of memory\n");
+	}
+
+	dev->d_open = vmstat_open;
+	dev->d_close = vmstat_close;
+	dev->d_io = vmstat_io;
+	dev->d_ioctl = vmstat_ioctl;
+	dev->d_blocks = 0;
+	dev->d_blocksize = 1;
+	dev->d_devnumber = 0;	/* assigned by vfs_adddev */
+	dev->d_data = NULL;
+
+	result = vfs_adddev("vmstat", dev, 0);
+	if (result) {
+		panic("vmstat: could not add device: %s\n", strerror(result));
+	}
+}
@@ -27,21 +27,16 @@
  * SUCH DAMAGE.
  */
 
-#include <string.h>
+#ifndef _SYS_MMAN_H_
+#define _SYS_MMAN_H_
 
-/*
- * C standard function - initialize a block of memory
- */
+#include <sys/types.h>
+#include <kern/mman.h>
+
+/* Returned by mmap on failure */
+#define MAP_FAILED ((void *)-1)
 
-void *
-memset(void *ptr, int ch, size_t len)
-{
-	char *p = ptr;
-	size_t i;
-	
-	for (i=0; i<len; i++) {
-		p[i] = ch;
-	}
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
+int munmap(void *addr, size_t len);
 
-	return ptr;
-}
+#endif /* _SYS_MMAN_H_ */
@@ -133,6 +133,23 @@ struct mheader {
 
 #define M_MKFIELD(off)	((off)>>MBLOCKSHIFT)
 
+/*
+ * Heap growth and shrinkage.
+ *
+ * When the heap has to grow, it grows by at least MGROWMIN bytes or
+ * half its current size, whichever is more, so a program that keeps
+ * allocating makes O(log n) sbrk calls instead of one per malloc.
+ * The kernel only hands out pages as they are touched, so the slack
+ * costs nothing until it is used.
+ *
+ * When free leaves a free block at the top of the heap that is at
+ * least MTRIMMIN bytes and half the heap, it is given back with a
+ * negative sbrk. Requiring more than the growth slack keeps a
+ * malloc/free pair at the top from bouncing the break up and down.
+ */
+#define MGROWMIN	4096
+#define MTRIMMIN	65536
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -334,7 +351,7 @@ malloc(size_t size)
 {
 	struct mheader *mh;
 	uintptr_t i;
-	size_t rightprevblock;
+	size_t rightprevblock, grow;
 
 	if (__heapbase==0) {
 		__malloc_init();
@@ -405,10 +422,24 @@ malloc(size_t size)
 	}
 
 	/*
-	 * Didn't find anything. Expand the heap.
+	 * Didn't find anything. Expand the heap, by extra if possible,
+	 * and split off what we don't need as a free block.
 	 */
 
-	mh = __malloc_sbrk(size + MBLOCKSIZE);
+	grow = (__heaptop - __heapbase) / 2;
+	if (grow < MGROWMIN) {
+		grow = MGROWMIN;
+	}
+	grow &= ~(size_t)(MBLOCKSIZE-1);
+	if (grow < size + MBLOCKSIZE) {
+		grow = size + MBLOCKSIZE;
+	}
+
+	mh = __malloc_sbrk(grow);
+	if (mh == NULL && grow > size + MBLOCKSIZE) {
+		grow = size + MBLOCKSIZE;
+		mh = __malloc_sbrk(grow);
+	}
 	if (mh == NULL) {
 		return NULL;
 	}
@@ -418,7 +449,9 @@ malloc(size_t size)
 	mh->mh_magic2 = MMAGIC;
 	mh->mh_pad = 0;
 	mh->mh_inuse = 1;
-	mh->mh_nextblock = M_MKFIELD(size + MBLOCKSIZE);
+	mh->mh_nextblock = M_MKFIELD(grow);
+
+	__malloc_split(mh, size);
 
 #ifdef MALLOCDEBUG
 	warnx("malloc: allocating at %p", M_DATA(mh));
@@ -475,6 +508,28 @@ __malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
 	__malloc_deadbeef(mhnext, sizeof(struct mheader));
 }
 
+/*
+ * Give the free block mh at the top of the heap back to the kernel,
+ * if it is big enough to be worth it.
+ */
+static
+void
+__malloc_trim(struct mheader *mh)
+{
+	size_t size;
+
+	size = M_NEXTOFF(mh);
+	if (size < MTRIMMIN || size < (__heaptop - __heapbase) / 2) {
+		return;
+	}
+
+	if (sbrk(-(int)size) == (void *)-1) {
+		/* keep it; it's still a perfectly good free block */
+		return;
+	}
+	__heaptop = (uintptr_t)mh;
+}
+
 /*
  * The actual free() implementation.
  */
@@ -530,6 +585,15 @@ free(void *x)
 	if (mh != (struct mheader *)__heapbase) {
 		mhprev = M_PREV(mh);
 		__malloc_trymerge(mhprev, mh);
+		if (!mhprev->mh_inuse) {
+			/* merged; mh's header is gone */
+			mh = mhprev;
+		}
+	}
+
+	/* If we're now the top block, maybe shrink the heap */
+	if (M_NEXT(mh) == (struct mheader *)__heaptop) {
+		__malloc_trim(mh);
 	}
 
 #ifdef MALLOCDEBUG